@@ -0,0 +1,51 @@
+// Growbot remote module settings and battery conversions
+//
+// Shared by the firmware (src/main.cpp) and the host tools in tools/ so that
+// simulations run with the firmware's own cadence, thresholds and budgets.
+
+#ifndef GROWBOT_CONFIG_H
+#define GROWBOT_CONFIG_H
+
+#define VERSION 5                 // firmware version
+#define SLEEP_MIN 60              // Sleep time in minutes
+#define UPLOAD_EVERY 8            // Upload data every x sleep cycles
+#define MOISTURE_WARN_VALUE 2100  // Warning moisture value
+#define BATTERY_WARN_VOLTAGE 3.35 // Warning battery voltage
+#define BATTERY_MIN_VOLTAGE 3.30  // Minimum battery voltage to operate
+#define BATTERY_MAX_VOLTAGE 4.10  // Maximum battery voltage for percentage calulation
+#define SENSOR_SAMPLES 50         // Number of sensor samples to take for avg
+#define SENSOR_DELAY_MS 50        // Delay between sensor reads in milliseconds
+#define BATTERY_SAMPLES 50        // Number of battery samples to take for avg
+#define BATTERY_DELAY_MS 50       // Delay between battery reads in milliseconds
+#define WAKE_BUDGET_SECS 45       // Maximum awake time per wake cycle in seconds
+#define HTTP_TIMEOUT_MS 5000      // Maximum time for a single API call in milliseconds
+#define HTTP_MIN_BUDGET_MS 1000   // Minimum wake budget left to attempt an API call in milliseconds
+#define API_SEND_DELAY_MS 10      // Delay between API calls in milliseconds
+
+#define BATTERY_DIVIDER_R1 100000.0f // battery voltage divider, high side
+#define BATTERY_DIVIDER_R2 220000.0f // battery voltage divider, low side
+
+// Calculate the voltage of the battery from an ADC average using the voltage divider equation
+static inline float battery_adc_to_voltage(float average)
+{
+    return average * (3.3f / 4095.0f) * (BATTERY_DIVIDER_R1 + BATTERY_DIVIDER_R2) / BATTERY_DIVIDER_R2;
+}
+
+// ADC value (including ADC_OFFSET) for a battery voltage
+static inline int battery_voltage_to_adc(float voltage)
+{
+    return (int)(voltage / battery_adc_to_voltage(1.0f));
+}
+
+// Battery percentage between BATTERY_MIN_VOLTAGE and BATTERY_MAX_VOLTAGE
+static inline int get_battery_pct(float voltage)
+{
+    int pct = (int)((voltage - BATTERY_MIN_VOLTAGE) * 100.0 / (BATTERY_MAX_VOLTAGE - BATTERY_MIN_VOLTAGE));
+    if (pct < 0)
+        pct = 0;
+    else if (pct > 100)
+        pct = 100;
+    return pct;
+}
+
+#endif // GROWBOT_CONFIG_H
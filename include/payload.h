@@ -0,0 +1,72 @@
+// Growbot sensor payload construction
+//
+// Shared by the firmware (src/main.cpp) and the host tools in tools/ so that
+// both produce byte-identical JSON for the Growbot API.
+
+#ifndef GROWBOT_PAYLOAD_H
+#define GROWBOT_PAYLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PAYLOAD_MAX_LEN 320 // Maximum length of a json payload including null terminator
+
+// Fields of one sensor reading as sent to the API
+struct sensor_payload
+{
+    const char *device_id; // last 4 hex digits of the mac address
+    int sensor_id;         // soil sensor gpio pin
+    int soil_value;        // averaged soil moisture ADC value
+    char status_bit;       // A, M, B, S or D
+    const char *batt_volt; // battery voltage formatted by format_battery_voltage()
+    int batt_pct;          // battery percentage
+    const char *timestamp; // timestamp formatted by format_timestamp()
+    const char *reason;    // system problem reason
+    int version;           // firmware version
+    unsigned latency_ms;   // wake to API delivery time of the module's previous alert, 0 to leave it out
+};
+
+// Format the reading timestamp, time must already be adjusted to calendar year and month
+static inline void format_timestamp(char *buf, size_t len, const struct tm *time)
+{
+    snprintf(buf, len, "%04d-%02d-%02d %02d:%02d:%02d", time->tm_year, time->tm_mon, time->tm_mday, time->tm_hour, time->tm_min, time->tm_sec);
+}
+
+// Format the battery voltage with 2 decimals
+static inline void format_battery_voltage(char *buf, size_t len, float volt)
+{
+    snprintf(buf, len, "%.2f", volt);
+}
+
+// Select the status bit for a reading
+// S: system problem, D: sensor disconnected, B: battery low, M: moisture warning, A: all ok
+static inline char payload_status_bit(int soil_value, const char *batt_volt, bool system_problem, int moisture_warn, float battery_warn)
+{
+    if (system_problem)
+        return 'S';
+    if (soil_value == 0)
+        return 'D';
+    if (atof(batt_volt) < battery_warn)
+        return 'B';
+    if (soil_value >= moisture_warn)
+        return 'M';
+    return 'A';
+}
+
+// Fields sent with every reading, build_payload() closes the object
+#define PAYLOAD_FORMAT "{\"device_id\":\"%s\",\"sensor_id\":%d,\"soil_value\":%d,\"status_bit\":\"%c\",\"batt_volt\":\"%s\",\"batt_pct\":%d,\"timestamp\":\"%s\",\"reason\":\"%s\",\"version\":%d"
+
+// Build the json payload, returns the payload length
+static inline int build_payload(char *buf, size_t len, const struct sensor_payload *p)
+{
+    if (p->latency_ms == 0)
+        return snprintf(buf, len, PAYLOAD_FORMAT "}",
+                        p->device_id, p->sensor_id, p->soil_value, p->status_bit, p->batt_volt, p->batt_pct, p->timestamp, p->reason, p->version);
+    return snprintf(buf, len, PAYLOAD_FORMAT ",\"last_alert_latency_ms\":%u}",
+                    p->device_id, p->sensor_id, p->soil_value, p->status_bit, p->batt_volt, p->batt_pct, p->timestamp, p->reason, p->version, p->latency_ms);
+}
+
+#endif // GROWBOT_PAYLOAD_H
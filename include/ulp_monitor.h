@@ -0,0 +1,150 @@
+// Growbot ULP soil monitor
+//
+// While the main cores are in deep sleep, the ULP coprocessor samples the soil
+// sensors and the battery every ULP_PERIOD_SECS, sums ULP_RECORD_SAMPLES samples
+// into one record of a ring buffer in RTC slow memory and wakes the main cores
+// only when a threshold is crossed, the ring buffer is full or the upload
+// interval has elapsed.
+//
+// The ulp_model_* functions are a host-side model of the ULP program built by
+// src/ulp_monitor.c. They work on the same 16 bit data layout, so the firmware
+// uses them to decode a snapshot of RTC memory and host tools can replay
+// readings through the same decision logic.
+
+#ifndef GROWBOT_ULP_MONITOR_H
+#define GROWBOT_ULP_MONITOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ULP_PERIOD_SECS 60      // ULP wake-up period, one sample per channel
+#define ULP_OVERSAMPLE_SHIFT 2  // each sample averages 1 << shift ADC conversions
+#define ULP_RECORD_SAMPLES 15   // samples summed into one ring buffer record, at most 16
+#define ULP_RING_RECORDS 36     // records in the RTC ring buffer, more than one upload interval
+#define ULP_MAX_CHANNELS 6      // up to 5 soil sensors and the battery
+#define ULP_HYSTERESIS 40       // ADC counts a channel must recover before it can alert again
+#define ULP_PROGRAM_WORDS 512   // RTC slow memory words reserved for the ULP program
+#define ULP_MAGIC 0x6b07        // marks initialized ULP data
+
+// Wake reasons
+#define ULP_WAKE_THRESHOLD 0x1 // a channel crossed its alert threshold
+#define ULP_WAKE_FULL 0x2      // the ring buffer is full
+#define ULP_WAKE_INTERVAL 0x4  // the upload interval elapsed
+
+// Data layout in 16 bit words, placed in RTC slow memory after the program
+#define ULP_VAR_WAKE 0                                        // pending wake reasons
+#define ULP_VAR_TICKS 1                                       // ULP periods since the last upload
+#define ULP_VAR_SAMPLES 2                                     // samples in the current record
+#define ULP_VAR_COUNT 3                                       // complete records in the ring buffer
+#define ULP_VAR_WPTR 4                                        // ring buffer word index of the next record
+#define ULP_VAR_MAGIC 5                                       // ULP_MAGIC once initialized
+#define ULP_VAR_SUM 8                                         // per channel sum of the current record
+#define ULP_VAR_LAST (ULP_VAR_SUM + ULP_MAX_CHANNELS)         // per channel latest sample
+#define ULP_VAR_LATCH (ULP_VAR_LAST + ULP_MAX_CHANNELS)       // per channel alert latch
+#define ULP_VAR_RING (ULP_VAR_LATCH + ULP_MAX_CHANNELS)       // ring buffer, channels words per record
+#define ULP_DATA_WORDS (ULP_VAR_RING + ULP_RING_RECORDS * ULP_MAX_CHANNELS)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    // Channels monitored by the ULP and their alert thresholds in raw ADC counts
+    struct ulp_monitor_config
+    {
+        uint8_t channels;                         // number of channels
+        uint8_t adc_channel[ULP_MAX_CHANNELS];    // ADC1 channel of each input
+        uint16_t threshold[ULP_MAX_CHANNELS];     // alert threshold
+        bool alert_high[ULP_MAX_CHANNELS];        // alert at or above (soil) or at or below (battery) the threshold
+        uint16_t upload_ticks;                    // ULP periods between uploads
+    };
+
+    // Reset the data area
+    static inline void ulp_model_init(uint16_t *mem)
+    {
+        memset(mem, 0, ULP_DATA_WORDS * sizeof(uint16_t));
+        mem[ULP_VAR_MAGIC] = ULP_MAGIC;
+    }
+
+    // Run one ULP period with one sample per channel, returns the wake reasons (0 keeps the main cores asleep)
+    static inline uint16_t ulp_model_step(uint16_t *mem, const struct ulp_monitor_config *cfg, const uint16_t *sample)
+    {
+        for (int c = 0; c < cfg->channels; c++)
+        {
+            uint16_t v = sample[c];
+            mem[ULP_VAR_LAST + c] = v;
+            mem[ULP_VAR_SUM + c] += v;
+            bool alert = cfg->alert_high[c] ? v >= cfg->threshold[c] : v <= cfg->threshold[c];
+            bool recovered = cfg->alert_high[c] ? v + ULP_HYSTERESIS < cfg->threshold[c] : v >= cfg->threshold[c] + ULP_HYSTERESIS;
+            if (alert && !mem[ULP_VAR_LATCH + c])
+            {
+                mem[ULP_VAR_LATCH + c] = 1;
+                mem[ULP_VAR_WAKE] |= ULP_WAKE_THRESHOLD;
+            }
+            else if (recovered)
+                mem[ULP_VAR_LATCH + c] = 0;
+        }
+        if (++mem[ULP_VAR_SAMPLES] >= ULP_RECORD_SAMPLES)
+        {
+            for (int c = 0; c < cfg->channels; c++)
+            {
+                mem[ULP_VAR_RING + mem[ULP_VAR_WPTR] + c] = mem[ULP_VAR_SUM + c];
+                mem[ULP_VAR_SUM + c] = 0;
+            }
+            mem[ULP_VAR_SAMPLES] = 0;
+            mem[ULP_VAR_WPTR] += cfg->channels;
+            if (mem[ULP_VAR_WPTR] >= ULP_RING_RECORDS * cfg->channels)
+                mem[ULP_VAR_WPTR] = 0;
+            if (mem[ULP_VAR_COUNT] < ULP_RING_RECORDS)
+                mem[ULP_VAR_COUNT]++;
+            if (mem[ULP_VAR_COUNT] >= ULP_RING_RECORDS)
+                mem[ULP_VAR_WAKE] |= ULP_WAKE_FULL;
+        }
+        if (++mem[ULP_VAR_TICKS] >= cfg->upload_ticks)
+            mem[ULP_VAR_WAKE] |= ULP_WAKE_INTERVAL;
+        return mem[ULP_VAR_WAKE];
+    }
+
+    // Average of each channel for a record, index 0 is the oldest record
+    static inline void ulp_model_record(const uint16_t *mem, int channels, int index, uint16_t *avg)
+    {
+        int count = mem[ULP_VAR_COUNT];
+        int slot = (mem[ULP_VAR_WPTR] / channels + ULP_RING_RECORDS - count + index) % ULP_RING_RECORDS;
+        for (int c = 0; c < channels; c++)
+            avg[c] = mem[ULP_VAR_RING + slot * channels + c] / ULP_RECORD_SAMPLES;
+    }
+
+    // Age in seconds of the end of a record, index 0 is the oldest record
+    static inline uint32_t ulp_model_record_age(const uint16_t *mem, int index)
+    {
+        return (uint32_t)(mem[ULP_VAR_SAMPLES] + (mem[ULP_VAR_COUNT] - 1 - index) * ULP_RECORD_SAMPLES) * ULP_PERIOD_SECS;
+    }
+
+    // Mark the records as handled by the main cores, alert latches stay set until the channel recovers
+    static inline void ulp_model_drain(uint16_t *mem, bool uploaded)
+    {
+        mem[ULP_VAR_WAKE] = 0;
+        mem[ULP_VAR_COUNT] = 0;
+        if (uploaded)
+            mem[ULP_VAR_TICKS] = 0;
+    }
+
+#ifdef ESP_PLATFORM
+#include <esp_err.h>
+
+    // Build and load the ULP program and start sampling
+    esp_err_t ulp_monitor_start(const struct ulp_monitor_config *cfg);
+
+    // Copy the ULP data area from RTC slow memory
+    void ulp_monitor_read(uint16_t *mem);
+
+    // Write the ULP data area back to RTC slow memory
+    void ulp_monitor_write(const uint16_t *mem);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // GROWBOT_ULP_MONITOR_H
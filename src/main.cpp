@@ -12,30 +12,37 @@
 #include <HTTPClient.h>
 #include <esp_sleep.h>
 #include <esp_task_wdt.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+#include <esp_sntp.h>
+#include <freertos/event_groups.h>
 #include <SPIFFS.h>
-#include <Mapf.h>
+#include "growbot_config.h"
+#include "payload.h"
+#include "ulp_monitor.h"
 
-// compile definitions
-#define VERSION 5                 // firmware version
+// compile definitions, module settings shared with the host tools are in include/growbot_config.h
 #undef RESET_DATA                 // reset datafile on boot
 #undef DEBUG_SERIAL               // enable serial debug
+                                  // uncomment CONFIG_PM_PROFILING in sdkconfig.defaults for power mode times
+#undef ULP_MONITOR                // sample with the ULP coprocessor in deep sleep, wake only when needed
+                                  // needs the ULP lines in sdkconfig.defaults (3 KB of RTC slow memory)
 #define CPU_FREQ_MHZ 80           // set CPU frequency in MHz Lower then 80 seems to fail wifi
-#define SLEEP_MIN 60              // Sleep time in minutes
-#define UPLOAD_EVERY 8            // Upload data every x sleep cycles
-#define MOISTURE_WARN_VALUE 2100  // Warning moisture value
-#define BATTERY_WARN_VOLTAGE 3.35 // Warning battery voltage
-#define BATTERY_MIN_VOLTAGE 3.30  // Minimum battery voltage to operate
-#define BATTERY_MAX_VOLTAGE 4.10  // Maximum battery voltage for percentage calulation
-#define SENSOR_SAMPLES 50         // Number of sensor samples to take for avg
-#define SENSOR_DELAY_MS 50        // Delay between sensor reads in milliseconds
-#define BATTERY_SAMPLES 50        // Number of battery samples to take for avg
-#define BATTERY_DELAY_MS 50       // Delay between battery reads in milliseconds
+#undef ALERT_LATENCY_FIELD        // send the previous alert's wake to API latency on live alerts (the API must accept it)
+#define PM_ENABLE                 // enable power management with automatic light sleep between samples
+#define CPU_SAMPLE_FREQ_MHZ 40    // CPU frequency in MHz while the radio is off (40, 20 or 10)
 #define WIFI_TIMEOUT_SECS 20      // Wifi connection timeout in seconds
+#define WIFI_BUDGET_PCT 50        // Share of the remaining wake budget for the wifi connection
 #define NTP_TIMEOUT_SECS 10       // set NTP server timeout in seconds
+#define NTP_BUDGET_PCT 25         // Share of the remaining wake budget for the NTP sync
 #define WDT_TIMEOUT_SECS 20       // watchdog timer timeout in seconds
-#define API_SEND_DELAY_MS 10      // Delay between API calls in milliseconds
 #define uS_TO_S_FACTOR 1000000    // Conversion factor for micro seconds to seconds
 #define BATTERY_PIN 39            // Analog input pin to read battery voltage
+#define REJECTED_MAX_BYTES 16384  // size of /rejected.txt before it moves to /rejected.old, dropping the older one
+
+#if defined(ULP_MONITOR) && !CONFIG_ESP32_ULP_COPROC_ENABLED
+#error "ULP_MONITOR needs CONFIG_ESP32_ULP_COPROC_ENABLED=y and CONFIG_ESP32_ULP_COPROC_RESERVE_MEM=3072 in sdkconfig.defaults"
+#endif
 
 // Only GPIO 32-36 (5 total) are ADC1 channels and are the only pins that can be used for soil_sensors
 // GPIO 39 is ADC1 also but is used for battery monitoring
@@ -56,6 +63,36 @@ char *ntp_server;                                                 // NTP server
 int iter;                                                         // loop iterator
 int ADC_OFFSET = 0;                                               // ADC offset value    
 
+// Wake phases used for power management and timing
+enum wake_phase
+{
+    PHASE_INIT,   // boot and peripheral initialization
+    PHASE_SAMPLE, // ADC sampling with the radio off
+    PHASE_RADIO,  // wifi, NTP and API uploads
+    PHASE_COUNT
+};
+int current_phase = PHASE_INIT;                                   // current wake phase
+int64_t phase_start_us = 0;                                       // time the current phase started
+int64_t phase_time_us[PHASE_COUNT];                               // time spent in each phase this wake
+RTC_DATA_ATTR uint32_t last_awake_ms = 0;                         // total awake time of the previous wake
+
+// Wifi and NTP events
+#define WIFI_CONNECTED_BIT BIT0                                   // station got an IP address
+#define WIFI_FAIL_BIT BIT1                                        // station cannot connect to the access point
+#define TIME_SYNCED_BIT BIT2                                      // NTP time sync completed
+EventGroupHandle_t wifi_events;                                   // wifi and NTP event group
+bool wifi_failed = false;                                         // wifi connection failed this wake
+
+// Uplink queue for the readings taken this wake
+struct uplink_entry
+{
+    String payload;  // json payload
+    char status_bit; // status bit of the reading
+};
+uplink_entry uplink_queue[sizeof(sensor_pins) / sizeof(sensor_pins[0])]; // one reading per sensor
+int uplink_length = 0;                                            // number of queued readings
+RTC_DATA_ATTR uint32_t last_alert_latency_ms = 0;                 // wake to API delivery time of the last alert sent
+
 // function definitions
 void show_last_restart_reason();
 void writeStringToEEPROM(int addrOffset, const char *str);
@@ -64,18 +101,39 @@ void writeIntToEEPROM(int addrOffset, int value);
 int readIntfromEEPROM(int addrOffset);
 String getMacLast4();
 String encryptPayload(String payload);
-void send_payload(String jsonPayload);
+bool send_payload(String jsonPayload, bool writespiff);
 void check_datafile();
+size_t read_datafile_pos();
+void write_datafile_pos(size_t pos);
+bool write_rejected(const String &line);
+int32_t budget_remaining_ms();
+int32_t budget_share_ms(int pct, int32_t max_ms);
+EventBits_t wait_for_events(EventBits_t bits, int32_t timeout_ms);
+void on_wifi_event(arduino_event_id_t event, arduino_event_info_t info);
+void on_time_sync(struct timeval *tv);
+bool is_alert(char status_bit);
+void queue_reading(String payload, char status_bit);
+bool flush_uplink_queue();
+void archive_uplink_queue();
 void write_spiff(String data);
 int get_avg_moisture(int aout_pin);
 bool set_time();
 tm get_time();
 float get_battery_voltage();
 float show_battery_voltage();
-int get_battery_pct(float volt);
 String removeNewlines(const char *inputString);
 bool isInteger(String str);
 void verify_adc_offset();
+void enter_phase(int phase);
+void show_phase_times();
+void show_pm_modes();
+char make_payload(char *json, const String &device_id, int sensor_id, int avg, const char *batteryVoltage, int batt_pct, const char *timestamp, bool live);
+void go_to_sleep();
+#ifdef ULP_MONITOR
+void format_time_ago(char *buf, size_t len, uint32_t age_s);
+void start_ulp_monitor();
+void handle_ulp_wake(const String &device_id);
+#endif
 #ifdef DEBUG_SERIAL
 void show_time();
 #endif
@@ -278,16 +336,23 @@ String removeNewlines(String inputString)
     return outputString;
 }
 
-// Send json sensor data to API
-void send_payload(String jsonPayload, bool writespiff)
+// Send json sensor data to API, returns true if the API accepted it
+bool send_payload(String jsonPayload, bool writespiff)
 {
-    if (WiFi.status() == WL_CONNECTED)
+    int32_t budget_ms = budget_remaining_ms();
+    if (WiFi.status() == WL_CONNECTED && budget_ms >= HTTP_MIN_BUDGET_MS)
     {
         api_url = readStringFromEEPROM(96);
 #ifdef DEBUG_SERIAL
         log_i("Using API URL: %s", api_url);
 #endif
         HTTPClient httpClient;
+        // Bound the API call by the wake budget so a slow server cannot keep the module awake,
+        // half of it for the connect and a quarter each for sending and waiting for the headers
+        int32_t call_ms = min((int32_t)HTTP_TIMEOUT_MS, budget_ms);
+        int64_t call_end_us = esp_timer_get_time() + (int64_t)call_ms * 1000;
+        httpClient.setConnectTimeout(call_ms / 2);
+        httpClient.setTimeout(call_ms / 4);
         httpClient.begin(api_url); // Replace with your API endpoint
         httpClient.addHeader("Content-Type", "application/json");
         httpClient.addHeader("Accept", "application/json");
@@ -300,14 +365,18 @@ void send_payload(String jsonPayload, bool writespiff)
 #ifdef DEBUG_SERIAL
         log_i("HTTP Response Code: %s", String(httpResponseCode));
 #endif
-        if (httpResponseCode != 500)
+        // Read the response body only with time left of this call
+        int32_t left_ms = (int32_t)((call_end_us - esp_timer_get_time()) / 1000);
+        if (httpResponseCode != 500 && httpResponseCode > 0 && left_ms > 0)
         {
+            httpClient.setTimeout(left_ms);
             String response = httpClient.getString();
             String resp = removeNewlines(response);
 #ifdef DEBUG_SERIAL
             log_i("HTTP Response: %s", resp.c_str());
 #endif
         }
+        httpClient.end();
         if (httpResponseCode == 200)
         {
 #ifdef DEBUG_SERIAL
@@ -315,6 +384,7 @@ void send_payload(String jsonPayload, bool writespiff)
 #endif
             http_success_bit = true;
             reset_iter();
+            return true;
         }
         else
         {
@@ -330,7 +400,15 @@ void send_payload(String jsonPayload, bool writespiff)
                 write_spiff(jsonPayload);
             }
         }
-        // httpClient.end();
+    }
+    else if (WiFi.status() == WL_CONNECTED)
+    {
+#ifdef DEBUG_SERIAL
+        log_w("Wake budget exhausted, not sending sensor data");
+#endif
+        http_success_bit = false;
+        if (writespiff)
+            write_spiff(jsonPayload);
     }
     else
     {
@@ -349,47 +427,129 @@ void send_payload(String jsonPayload, bool writespiff)
 #endif
         }
     }
+    return false;
 }
 
-// Check if there is any sensor data stored on the spiff partition
+// Offset of the first unsent entry in the data file, 0 if unknown
+size_t read_datafile_pos()
+{
+    File pos_file = SPIFFS.open("/data.pos", FILE_READ);
+    if (!pos_file)
+        return 0;
+    String value = pos_file.readStringUntil('\n');
+    pos_file.close();
+    return isInteger(value) ? value.toInt() : 0;
+}
+
+// Save the offset of the first unsent entry, a lost or torn write only causes resends
+void write_datafile_pos(size_t pos)
+{
+    File pos_file = SPIFFS.open("/data.pos", FILE_WRITE);
+    if (pos_file)
+    {
+        pos_file.println(pos);
+        pos_file.close();
+    }
+}
+
+// Set aside an archived entry the API refused for good, keeping at most about twice
+// REJECTED_MAX_BYTES of them: a full file moves to /rejected.old, dropping the older entries
+bool write_rejected(const String &line)
+{
+    File rejected_file = SPIFFS.open("/rejected.txt", FILE_APPEND);
+    if (!rejected_file)
+        return false;
+    size_t size = rejected_file.size();
+    bool saved = rejected_file.println(line) > 0;
+    rejected_file.close();
+    if (size + line.length() + 2 > REJECTED_MAX_BYTES)
+    {
+        SPIFFS.remove("/rejected.old");
+        SPIFFS.rename("/rejected.txt", "/rejected.old");
+#ifdef DEBUG_SERIAL
+        log_w("Rejected entries moved to /rejected.old, older ones dropped");
+#endif
+    }
+    return saved;
+}
+
+// Send the archived sensor data on the spiff partition, oldest first, within the wake budget
+// The data file is never rewritten: sent entries are skipped through the offset in /data.pos and
+// the file is only removed once every entry has been sent
 void check_datafile()
 {
-    // Check if the data file exists on the spiff partition
     if (!SPIFFS.exists("/data.txt"))
     {
 #ifdef DEBUG_SERIAL
         log_i("No archived sensor data was found on SPIFFS");
 #endif
+        return;
     }
-    else
+    File data_file = SPIFFS.open("/data.txt", FILE_READ);
+    if (!data_file)
+    {
+#ifdef DEBUG_SERIAL
+        log_e("Cannot open the SPIFFS data file");
+#endif
+        return;
+    }
+    size_t size = data_file.size();
+    size_t pos = read_datafile_pos();
+    if (pos > size)
+        pos = 0;
+    data_file.seek(pos);
+#ifdef DEBUG_SERIAL
+    log_i("Processing archived sensor data on SPIFFS from offset %u of %u", pos, size);
+#endif
+    int sent = 0;
+    while (data_file.position() < size)
     {
-        File data_file = SPIFFS.open("/data.txt", FILE_READ);
-        if (!data_file)
+        esp_task_wdt_reset();
+        if (budget_remaining_ms() < HTTP_MIN_BUDGET_MS)
         {
 #ifdef DEBUG_SERIAL
-            log_i("No archived sensor data was found on SPIFFS");
+            log_w("Wake budget exhausted, keeping the rest of the SPIFFS data file");
 #endif
+            break;
         }
-        else
+        size_t start = data_file.position();
+        String line = data_file.readStringUntil('\n');
+        line.trim();
+        if (line == "")
+            continue;
+        httpResponseCode = 0;
+        if (send_payload(line, false))
         {
+            sent++;
+            delay(API_SEND_DELAY_MS);
+            continue;
+        }
+        // The API refused this entry for good, set it aside instead of blocking the backlog
+        if (httpResponseCode >= 400 && httpResponseCode < 500 && httpResponseCode != 408 && httpResponseCode != 429 &&
+            write_rejected(line))
+            continue;
+        // Network or server failure, retry from this entry on the next upload
+        data_file.seek(start);
+        break;
+    }
+    bool done = data_file.position() >= size;
+    size_t new_pos = data_file.position();
+    data_file.close();
+    if (done)
+    {
 #ifdef DEBUG_SERIAL
-            log_i("Processing archived sensor data entries found on SPIFFS");
+        log_i("Sent %d entries, removing completed data file from SPIFFS", sent);
 #endif
-            for (String line = data_file.readStringUntil('\n'); line != ""; line = data_file.readStringUntil('\n'))
-            {
-                send_payload(line, false);
-                delay(API_SEND_DELAY_MS);
-            }
-            data_file.close();
-            if (http_success_bit)
-            {
-// Delete the file
+        // Remove the offset first, a reset in between resends entries instead of skipping new ones
+        SPIFFS.remove("/data.pos");
+        SPIFFS.remove("/data.txt");
+    }
+    else if (new_pos != pos)
+    {
 #ifdef DEBUG_SERIAL
-                log_i("Removing completed data file from SPIFFS");
+        log_w("Sent %d entries, %u bytes of the SPIFFS data file left", sent, size - new_pos);
 #endif
-                SPIFFS.remove("/data.txt");
-            }
-        }
+        write_datafile_pos(new_pos);
     }
 }
 
@@ -466,33 +626,108 @@ bool is_wifi_connected()
         return false;
 }
 
+// Milliseconds left in the wake budget
+int32_t budget_remaining_ms()
+{
+    int64_t left_ms = (int64_t)WAKE_BUDGET_SECS * 1000 - esp_timer_get_time() / 1000;
+    return left_ms > 0 ? (int32_t)left_ms : 0;
+}
+
+// Time allowed for a phase: its share of the remaining wake budget, capped at max_ms
+int32_t budget_share_ms(int pct, int32_t max_ms)
+{
+    int32_t share_ms = budget_remaining_ms() * pct / 100;
+    return share_ms < max_ms ? share_ms : max_ms;
+}
+
+// Wait until any of the event bits is set or the timeout expires, feeding the watchdog while waiting
+EventBits_t wait_for_events(EventBits_t bits, int32_t timeout_ms)
+{
+    int64_t end_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+    EventBits_t set = xEventGroupGetBits(wifi_events) & bits;
+    while (!set)
+    {
+        esp_task_wdt_reset();
+        int64_t left_ms = (end_us - esp_timer_get_time()) / 1000;
+        if (left_ms <= 0)
+            break;
+        // Never block longer than half the watchdog timeout
+        int32_t wait_ms = min(left_ms, (int64_t)WDT_TIMEOUT_SECS * 500);
+        set = xEventGroupWaitBits(wifi_events, bits, pdFALSE, pdFALSE, pdMS_TO_TICKS(wait_ms)) & bits;
+    }
+    esp_task_wdt_reset();
+    return set;
+}
+
+// Wifi event handler
+void on_wifi_event(arduino_event_id_t event, arduino_event_info_t info)
+{
+    switch (event)
+    {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+        xEventGroupSetBits(wifi_events, WIFI_CONNECTED_BIT);
+        break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+        xEventGroupClearBits(wifi_events, WIFI_CONNECTED_BIT);
+        // Retrying cannot help if the access point is missing or rejects the credentials
+        switch (info.wifi_sta_disconnected.reason)
+        {
+        case WIFI_REASON_NO_AP_FOUND:
+        case WIFI_REASON_AUTH_FAIL:
+        case WIFI_REASON_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+            xEventGroupSetBits(wifi_events, WIFI_FAIL_BIT);
+            break;
+        default:
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// NTP time sync notification
+void on_time_sync(struct timeval *tv)
+{
+    xEventGroupSetBits(wifi_events, TIME_SYNCED_BIT);
+}
+
 void connect_wifi()
 {
+    enter_phase(PHASE_RADIO);
     if (WiFi.status() != WL_CONNECTED)
     {
+        if (wifi_failed || budget_remaining_ms() < HTTP_MIN_BUDGET_MS)
+        {
+#ifdef DEBUG_SERIAL
+            log_w("Skipping wifi connection, failed earlier or wake budget exhausted");
+#endif
+            enter_phase(PHASE_SAMPLE);
+            return;
+        }
         char *ssid = readStringFromEEPROM(0);
         char *password = readStringFromEEPROM(48);
+        xEventGroupClearBits(wifi_events, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT);
         WiFi.begin(ssid, password);
 #ifdef DEBUG_SERIAL
         log_i("Connecting to WiFi...");
 #endif
-        for (int i = 0; i < WIFI_TIMEOUT_SECS * 10; i++)
+        EventBits_t bits = wait_for_events(WIFI_CONNECTED_BIT | WIFI_FAIL_BIT, budget_share_ms(WIFI_BUDGET_PCT, WIFI_TIMEOUT_SECS * 1000));
+        if (bits & WIFI_CONNECTED_BIT)
         {
-            if (WiFi.status() == WL_CONNECTED)
-            {
 #ifdef DEBUG_SERIAL
-                log_i("Connected to WiFi");
+            log_i("Connected to WiFi");
 #endif
-                break;
-            }
-            esp_task_wdt_reset();
-            delay(100);
         }
-        if (WiFi.status() != WL_CONNECTED)
+        else
         {
 #ifdef DEBUG_SERIAL
             log_e("Failed to connect to WiFi");
 #endif
+            wifi_failed = true;
+            WiFi.mode(WIFI_OFF);
+            enter_phase(PHASE_SAMPLE);
         }
     }
     // Sync time with NTP server
@@ -505,9 +740,16 @@ void connect_wifi()
 #ifdef DEBUG_SERIAL
         log_i("Using NTP server: %s", ntp_server);
 #endif
+        xEventGroupClearBits(wifi_events, TIME_SYNCED_BIT);
         configTime(0, 0, ntp_server);
-        esp_task_wdt_reset();
-        check_datafile();
+        // The RTC keeps time through deep sleep, only wait for the sync if the time is not set yet
+        struct tm time;
+        if (!getLocalTime(&time, 0) && !wait_for_events(TIME_SYNCED_BIT, budget_share_ms(NTP_BUDGET_PCT, NTP_TIMEOUT_SECS * 1000)))
+        {
+#ifdef DEBUG_SERIAL
+            log_e("NTP time sync timed out");
+#endif
+        }
     }
 #ifdef DEBUG_SERIAL
     else
@@ -516,6 +758,79 @@ void connect_wifi()
 
 }
 
+// Status changes (M, B, S, D) are alerts and are sent ahead of everything else
+bool is_alert(char status_bit)
+{
+    return status_bit != 'A';
+}
+
+// Queue a reading for upload
+void queue_reading(String payload, char status_bit)
+{
+    uplink_queue[uplink_length].payload = payload;
+    uplink_queue[uplink_length].status_bit = status_bit;
+    uplink_length++;
+}
+
+// Send the queued readings, alerts first. Offline readings are archived right away, readings the
+// API did not accept stay queued for archive_uplink_queue(). Returns false if the API failed.
+bool flush_uplink_queue()
+{
+    bool connected = is_wifi_connected();
+    bool api_ok = true;
+    bool sent[sizeof(uplink_queue) / sizeof(uplink_queue[0])] = {false};
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bool alerts = (pass == 0);
+        for (int i = 0; i < uplink_length; i++)
+        {
+            if (is_alert(uplink_queue[i].status_bit) != alerts)
+                continue;
+            esp_task_wdt_reset();
+            if (!connected)
+            {
+                send_payload(uplink_queue[i].payload, true);
+                sent[i] = true;
+                continue;
+            }
+            sent[i] = send_payload(uplink_queue[i].payload, false);
+            if (!sent[i])
+                api_ok = false;
+            else if (alerts)
+            {
+                // The wake started at boot
+                uint32_t latency_ms = (uint32_t)(esp_timer_get_time() / 1000);
+#ifdef DEBUG_SERIAL
+                log_i("Alert [%c] delivered [%ums] after wake (previous alert [%ums])",
+                      uplink_queue[i].status_bit, latency_ms, last_alert_latency_ms);
+#endif
+                last_alert_latency_ms = latency_ms;
+            }
+        }
+    }
+    // Keep the readings that were not sent, in queue order
+    int kept = 0;
+    for (int i = 0; i < uplink_length; i++)
+    {
+        if (!sent[i])
+            uplink_queue[kept++] = uplink_queue[i];
+    }
+    uplink_length = kept;
+    return api_ok;
+}
+
+// Archive the readings the API did not accept this wake
+void archive_uplink_queue()
+{
+    for (int i = 0; i < uplink_length; i++)
+        write_spiff(uplink_queue[i].payload);
+#ifdef DEBUG_SERIAL
+    if (uplink_length > 0)
+        log_w("Saved %d unsent readings to SPIFFS", uplink_length);
+#endif
+    uplink_length = 0;
+}
+
 // Show current datetime
 void show_time()
 {
@@ -527,7 +842,7 @@ void show_time()
 tm get_time()
 {
     struct tm time;
-    if (!getLocalTime(&time))
+    if (!getLocalTime(&time, 0))
     {
         #ifdef DEBUG_SERIAL
         log_e("Could not obtain time info from RTC, trying NTP sync");
@@ -535,7 +850,7 @@ tm get_time()
         // Initialize wifi
         connect_wifi();
         // Log the current time to console
-        getLocalTime(&time);
+        getLocalTime(&time, 0);
         time.tm_year += 1900;
         time.tm_mon += 1;
         return time;
@@ -582,20 +897,7 @@ float get_battery_voltage()
     float average = (float)total / (float)(BATTERY_SAMPLES);
     log_d("Battery ADC Average: %0.2f", average);
     // Calculate the voltage of the battery using the voltage divider equation
-    float r1 = 100000.0;
-    float r2 = 220000.0;
-    float vBattery = average * (3.3f / 4095.0f) * (r1 + r2) / r2;
-    return vBattery;
-}
-
-int get_battery_pct(float voltage)
-{
-    int pct = mapf(voltage, BATTERY_MIN_VOLTAGE, BATTERY_MAX_VOLTAGE, 0, 100);
-    if (pct < 0)
-        pct = 0;
-    else if (pct > 100)
-        pct = 100;
-    return pct;
+    return battery_adc_to_voltage(average);
 }
 
 void verify_adc_offset()
@@ -623,9 +925,209 @@ void verify_adc_offset()
     #endif
 }
 
+// Switch to a new wake phase, accounting the time spent in the previous one and
+// selecting the clock and sleep mode for the new one
+void enter_phase(int phase)
+{
+    int64_t now = esp_timer_get_time();
+    phase_time_us[current_phase] += now - phase_start_us;
+    phase_start_us = now;
+    current_phase = phase;
+    int max_mhz = (phase == PHASE_RADIO) ? CPU_FREQ_MHZ : CPU_SAMPLE_FREQ_MHZ;
+#ifdef PM_ENABLE
+    // While sampling, the core idles in automatic light sleep during every delay() between ADC reads.
+    // While the radio is up, the clock drops to the sampling frequency whenever wifi holds no lock.
+    esp_pm_config_esp32_t pm_config;
+    pm_config.max_freq_mhz = max_mhz;
+    pm_config.min_freq_mhz = CPU_SAMPLE_FREQ_MHZ;
+    pm_config.light_sleep_enable = (phase != PHASE_RADIO);
+    if (esp_pm_configure(&pm_config) == ESP_OK)
+        return;
+#ifdef DEBUG_SERIAL
+    log_w("Power management not available, using fixed CPU frequency");
+#endif
+#endif
+    if (getCpuFrequencyMhz() != max_mhz)
+        setCpuFrequencyMhz(max_mhz);
+}
+
+// Show the time spent in each wake phase
+void show_phase_times()
+{
+    enter_phase(current_phase);
+    uint32_t awake_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    log_i("Wake timing: init [%dms] sample [%dms] radio [%dms] total [%ums] (previous wake [%ums])",
+          (int)(phase_time_us[PHASE_INIT] / 1000), (int)(phase_time_us[PHASE_SAMPLE] / 1000),
+          (int)(phase_time_us[PHASE_RADIO] / 1000), awake_ms, last_awake_ms);
+    show_pm_modes();
+}
+
+// Show the time spent at each clock and in light sleep (mode SLEEP) this wake,
+// phase times alone cannot show it as delay() takes as long with or without light sleep
+void show_pm_modes()
+{
+#ifdef CONFIG_PM_PROFILING
+    char *dump = NULL;
+    size_t len = 0;
+    FILE *stream = open_memstream(&dump, &len);
+    if (stream == NULL)
+        return;
+    esp_pm_dump_locks(stream);
+    fclose(stream);
+    // Mode stats rows: mode, CPU frequency, time in us, share of the time since boot
+    char *line = strstr(dump, "Mode stats:");
+    while (line != NULL)
+    {
+        char mode[16];
+        int mhz, pct;
+        long long us;
+        if (sscanf(line, "%15s %dM %lld %d%%", mode, &mhz, &us, &pct) == 4)
+            log_i("Power mode %s at %dMHz [%lldms] (%d%%)", mode, mhz, us / 1000, pct);
+        line = strchr(line, '\n');
+        if (line != NULL)
+            line++;
+    }
+    free(dump);
+#else
+    log_i("Power mode times need CONFIG_PM_PROFILING=y in sdkconfig.defaults");
+#endif
+}
+
+// Build the json payload for one reading, returns its status bit
+// live is false for readings from the ULP ring buffer, which go straight to the archive
+char make_payload(char *json, const String &device_id, int sensor_id, int avg, const char *batteryVoltage, int batt_pct, const char *timestamp, bool live)
+{
+    char status_bit = payload_status_bit(avg, batteryVoltage, system_problem, MOISTURE_WARN_VALUE, BATTERY_WARN_VOLTAGE);
+    unsigned latency_ms = 0; // 0 leaves the field out
+#ifdef ALERT_LATENCY_FIELD
+    if (live && is_alert(status_bit))
+        latency_ms = last_alert_latency_ms;
+#endif
+    struct sensor_payload reading = {device_id.c_str(), sensor_id, avg, status_bit, batteryVoltage, batt_pct, timestamp, problem_reason.c_str(), VERSION, latency_ms};
+    build_payload(json, PAYLOAD_MAX_LEN, &reading);
+    return status_bit;
+}
+
+#ifdef ULP_MONITOR
+// Format the timestamp of a reading taken age_s seconds ago
+void format_time_ago(char *buf, size_t len, uint32_t age_s)
+{
+    time_t when = time(NULL) - age_s;
+    struct tm time;
+    localtime_r(&when, &time);
+    time.tm_year += 1900;
+    time.tm_mon += 1;
+    format_timestamp(buf, len, &time);
+}
+
+// Start the ULP monitor for the soil sensors and the battery
+void start_ulp_monitor()
+{
+    struct ulp_monitor_config cfg;
+    cfg.channels = sensor_length + 1;
+    for (int i = 0; i < sensor_length; i++)
+    {
+        cfg.adc_channel[i] = digitalPinToAnalogChannel(sensor_pins[i]);
+        cfg.threshold[i] = constrain(MOISTURE_WARN_VALUE - ADC_OFFSET, 0, 4095);
+        cfg.alert_high[i] = true;
+    }
+    cfg.adc_channel[sensor_length] = digitalPinToAnalogChannel(BATTERY_PIN);
+    cfg.threshold[sensor_length] = constrain(battery_voltage_to_adc(BATTERY_WARN_VOLTAGE) - ADC_OFFSET, 0, 4095);
+    cfg.alert_high[sensor_length] = false;
+    cfg.upload_ticks = SLEEP_MIN * UPLOAD_EVERY * 60 / ULP_PERIOD_SECS;
+    uint16_t mem[ULP_DATA_WORDS];
+    ulp_monitor_read(mem);
+    if (mem[ULP_VAR_MAGIC] != ULP_MAGIC)
+    {
+        ulp_model_init(mem);
+        ulp_monitor_write(mem);
+    }
+    esp_err_t err = ulp_monitor_start(&cfg);
+    if (err != ESP_OK)
+    {
+#ifdef DEBUG_SERIAL
+        log_e("Failed to start the ULP monitor [%d], using the sleep timer", err);
+#endif
+        return;
+    }
+    // The timer only wakes the module if the ULP stops working
+    esp_sleep_enable_timer_wakeup((uint64_t)SLEEP_MIN * UPLOAD_EVERY * 2 * 60 * uS_TO_S_FACTOR);
+}
+
+// Handle a wake by the ULP: archive the ring buffer records, queue the latest
+// sample as the live reading and upload if an alert or the upload interval woke us
+void handle_ulp_wake(const String &device_id)
+{
+    uint16_t mem[ULP_DATA_WORDS];
+    uint16_t values[ULP_MAX_CHANNELS];
+    char timestamp[20];
+    char batteryVoltage[10];
+    char jsonPayload[PAYLOAD_MAX_LEN];
+    int channels = sensor_length + 1;
+    ulp_monitor_read(mem);
+    uint16_t reason = mem[ULP_VAR_WAKE];
+    int records = mem[ULP_VAR_COUNT];
+#ifdef DEBUG_SERIAL
+    log_i("ULP wake reason [%d] with %d records", reason, records);
+#endif
+    // Readings are archived while offline, whatever the loop counter says
+    iter = 1;
+    for (int r = 0; r < records; r++)
+    {
+        ulp_model_record(mem, channels, r, values);
+        format_time_ago(timestamp, sizeof(timestamp), ulp_model_record_age(mem, r));
+        float bv = battery_adc_to_voltage(values[sensor_length] + ADC_OFFSET);
+        format_battery_voltage(batteryVoltage, sizeof(batteryVoltage), bv);
+        for (int i = 0; i < sensor_length; i++)
+        {
+            make_payload(jsonPayload, device_id, sensor_pins[i], values[i] + ADC_OFFSET, batteryVoltage, get_battery_pct(bv), timestamp, false);
+            write_spiff(String(jsonPayload));
+        }
+    }
+    // The latest sample is the live reading
+    format_time_ago(timestamp, sizeof(timestamp), 0);
+    float bv = battery_adc_to_voltage(mem[ULP_VAR_LAST + sensor_length] + ADC_OFFSET);
+    format_battery_voltage(batteryVoltage, sizeof(batteryVoltage), bv);
+    for (int i = 0; i < sensor_length; i++)
+    {
+        char status_bit = make_payload(jsonPayload, device_id, sensor_pins[i], mem[ULP_VAR_LAST + i] + ADC_OFFSET, batteryVoltage, get_battery_pct(bv), timestamp, true);
+        queue_reading(String(jsonPayload), status_bit);
+    }
+    bool upload = (reason & (ULP_WAKE_THRESHOLD | ULP_WAKE_INTERVAL)) || !spiff_ready;
+    if (upload)
+        connect_wifi();
+    // Skip the backlog if the API just failed a live reading
+    if (flush_uplink_queue() && is_wifi_connected())
+        check_datafile();
+    archive_uplink_queue();
+    // An upload attempt restarts the interval even if it failed, the data stays archived
+    ulp_model_drain(mem, upload);
+    ulp_monitor_write(mem);
+}
+#endif
+
+// Go to deep sleep until the next reading
+void go_to_sleep()
+{
+    EEPROM.end();
+    last_awake_ms = (uint32_t)(esp_timer_get_time() / 1000);
+#ifdef ULP_MONITOR
+    start_ulp_monitor();
+#endif
+#ifdef DEBUG_SERIAL
+    show_phase_times();
+    if (system_problem)
+        log_w("System problem detected: %s", problem_reason.c_str());
+    log_w("Tasks complete, going to sleep for %d minutes", SLEEP_MIN);
+#endif
+    // Turn off the status LED
+    digitalWrite(22, HIGH);
+    esp_deep_sleep_start();
+}
+
 extern "C" void app_main()
 {
-    setCpuFrequencyMhz(CPU_FREQ_MHZ);
+    enter_phase(PHASE_INIT);
     // Set internal status LED pin
     pinMode(22, OUTPUT);
     // Turn on internal status LED
@@ -638,6 +1140,10 @@ extern "C" void app_main()
     #endif
     // Initialize flash
     nvs_flash_init();
+    // Initialize the wifi and NTP event handling
+    wifi_events = xEventGroupCreate();
+    WiFi.onEvent(on_wifi_event);
+    sntp_set_time_sync_notification_cb(on_time_sync);
     // Initialize the time struct
     struct tm time;
     // Initialize the Hardware Watchdog
@@ -668,6 +1174,7 @@ extern "C" void app_main()
     else
         spiff_ready = true;
     #ifdef RESET_DATA
+    SPIFFS.remove("/data.pos");
     SPIFFS.remove("/data.txt");
     #endif
     // Set ADC resolution to 12 bits (4096 levels)
@@ -678,6 +1185,15 @@ extern "C" void app_main()
     String device_id = getMacLast4().substring(getMacLast4().length() - 4);
     verify_adc_offset();
     esp_task_wdt_reset();
+    enter_phase(PHASE_SAMPLE);
+#ifdef ULP_MONITOR
+    // The ULP already sampled the sensors and the battery
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_ULP)
+    {
+        handle_ulp_wake(device_id);
+        go_to_sleep();
+    }
+#endif
     #ifdef DEBUG_SERIAL
     log_i("Initialization Complete.");
     log_i("Device Address: %s", WiFi.macAddress().c_str());
@@ -692,21 +1208,20 @@ extern "C" void app_main()
     #ifdef DEBUG_SERIAL
     log_i("Sensor loop counter %d of %d", iter, UPLOAD_EVERY);
     #endif
-    if (!getLocalTime(&time))
+    if (!getLocalTime(&time, 0))
     {
     #ifdef DEBUG_SERIAL
         log_i("Time not set, setting time...");
     #endif
         time = get_time();
     }
-    if (iter >= UPLOAD_EVERY || !spiff_ready)
+    bool upload_due = (iter >= UPLOAD_EVERY || !spiff_ready);
+    if (upload_due)
     {
     #ifdef DEBUG_SERIAL
         log_i("Loop counter end reached, uploading data to API");
     #endif
         iter = 1;
-        // Initialize wifi
-        connect_wifi();
     }
     else
         iter++;
@@ -717,82 +1232,47 @@ extern "C" void app_main()
     #ifdef DEBUG_SERIAL
     log_i("Starting moisture read loop for %d connected sensors", sensor_length);
     #endif
-    // initialize memory for the timestamp
-    char *ts = (char *)malloc(20);
     // Format the timestamp for the payload
+    char timestamp[20];
     time = get_time();
-    sprintf(ts, "%04d-%02d-%02d %02d:%02d:%02d", time.tm_year, time.tm_mon, time.tm_mday, time.tm_hour, time.tm_min, time.tm_sec);
-    String timestamp = String(ts);
-    // prevent ts from memory leak
-    free(ts);
+    format_timestamp(timestamp, sizeof(timestamp), &time);
     char batteryVoltage[10];
-    sprintf(batteryVoltage, "%.2f", bv);
-    String status_bit = "0";
+    format_battery_voltage(batteryVoltage, sizeof(batteryVoltage), bv);
+    char status_bit;
     int batt_pct = get_battery_pct(bv);
-    // If Battery is under warning threshold, connect to wifi, upload data, and reset iter counter
-    if (bv <= BATTERY_WARN_VOLTAGE && !is_wifi_connected() && iter != 1)
-    {
-        #ifdef DEBUG_SERIAL
-        log_w("Battery voltage is under warning threshold! Forcing connect [%0.2fv] (%d%%)", bv, batt_pct);
-        #endif
-        connect_wifi();
-    }
+    bool alert = false;
     for (int i = 0; i < sensor_length; i++)
     {
         esp_task_wdt_reset();
         // Get the average moisture value from the sensor
         avg = get_avg_moisture(sensor_pins[i]);
-        // If Moisture is under warning threshold, connect to wifi, upload data, and reset iter counter
-        if (avg <= MOISTURE_WARN_VALUE && !is_wifi_connected() && iter != 1)
-        {
-            #ifdef DEBUG_SERIAL
-            log_w("Moisture is under warning threshold! Forcing connect [%d/2100]", avg);
-            #endif
-            connect_wifi();
-        }
+        // Build the json payload and queue it for upload
+        char jsonPayload[PAYLOAD_MAX_LEN];
+        status_bit = make_payload(jsonPayload, device_id, sensor_pins[i], avg, batteryVoltage, batt_pct, timestamp, true);
+        #ifdef DEBUG_SERIAL
         if (avg == 0)
-        {
-            #ifdef DEBUG_SERIAL
             log_e("Sensor %d is not connected!", sensor_pins[i]);
-            #endif
-            if (system_problem)
-                status_bit = "S";
-            else
-                status_bit = "D";
-            // Build the json payload
-            String jsonPayload = "{\"device_id\":\"" + String(device_id) + "\",\"sensor_id\":" + String(sensor_pins[i]) + ",\"soil_value\":" + String(avg) + ",\"status_bit\":\"" + String(status_bit) + "\",\"batt_volt\":\"" + String(batteryVoltage) + "\",\"batt_pct\":" + String(batt_pct) + ",\"timestamp\":\"" + timestamp.c_str() + "\",\"reason\":\"" + problem_reason + "\",\"version\":" + String(VERSION) + "}";
-            // Send the payload to the API
-            send_payload(jsonPayload, true);
-            continue;
-        }
         else
-        {
-            if (system_problem)
-                status_bit = "S";
-            else if (atof(batteryVoltage) < BATTERY_WARN_VOLTAGE)
-                status_bit = "B";
-            else if (avg >= MOISTURE_WARN_VALUE)
-                status_bit = "M";
-            else
-                status_bit = "A";
-            #ifdef DEBUG_SERIAL
-            log_i("Sensor:%d  Moisture value:%d  Battery:%sv(%d%%)  Status:%s  Timestamp:%s", sensor_pins[i], avg, String(batteryVoltage), batt_pct, status_bit, timestamp.c_str());
-            #endif
-            // Build the json payload
-            String jsonPayload = "{\"device_id\":\"" + String(device_id) + "\",\"sensor_id\":" + String(sensor_pins[i]) + ",\"soil_value\":" + String(avg) + ",\"status_bit\":\"" + String(status_bit) + "\",\"batt_volt\":\"" + String(batteryVoltage) + "\",\"batt_pct\":" + batt_pct + ",\"timestamp\":\"" + timestamp.c_str() + "\",\"reason\":\"" + problem_reason + "\",\"version\":" + String(VERSION) + "}";
-            // Send the payload to the API
-            send_payload(jsonPayload, true);
-            continue;
-        }
+            log_i("Sensor:%d  Moisture value:%d  Battery:%sv(%d%%)  Status:%c  Timestamp:%s", sensor_pins[i], avg, batteryVoltage, batt_pct, status_bit, timestamp);
+        #endif
+        queue_reading(String(jsonPayload), status_bit);
+        if (is_alert(status_bit))
+            alert = true;
     }
+    // If a reading changed status, connect to wifi, upload data, and reset iter counter
+    #ifdef DEBUG_SERIAL
+    if (alert && !upload_due)
+        log_w("Sensor status changed! Forcing connect [%0.2fv] (%d%%)", bv, batt_pct);
+    #endif
+    if (upload_due || alert)
+        connect_wifi();
+    // Live readings go first, alerts ahead of normal readings
+    bool api_ok = flush_uplink_queue();
+    // Drain the archived backlog with whatever is left of the wake budget, unless the API
+    // just failed a live reading, then archive the live readings it did not accept
+    if (api_ok && is_wifi_connected())
+        check_datafile();
+    archive_uplink_queue();
     // After all sensors are read, goto sleep until next reading
-    EEPROM.end();
-#ifdef DEBUG_SERIAL
-    if (system_problem)
-        log_w("System problem detected: %s", problem_reason.c_str());
-    log_w("Tasks complete, going to sleep for %d minutes", SLEEP_MIN);
-#endif
-    // Turn off the status LED
-    digitalWrite(22, HIGH);
-    esp_deep_sleep_start();
+    go_to_sleep();
 }
\ No newline at end of file
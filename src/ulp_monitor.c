@@ -0,0 +1,180 @@
+// Growbot ULP soil monitor
+//
+// Builds the ULP coprocessor program that implements ulp_model_step() from
+// include/ulp_monitor.h, and moves the data area between RTC slow memory and
+// the main cores.
+
+#include <esp32/ulp.h>
+#include <driver/adc.h>
+#include <esp_sleep.h>
+#include <soc/rtc.h>
+#include <soc/rtc_cntl_reg.h>
+#include <sdkconfig.h>
+#include "ulp_monitor.h"
+
+#if CONFIG_ESP32_ULP_COPROC_ENABLED
+_Static_assert((ULP_PROGRAM_WORDS + ULP_DATA_WORDS) * 4 <= CONFIG_ESP32_ULP_COPROC_RESERVE_MEM,
+               "CONFIG_ESP32_ULP_COPROC_RESERVE_MEM is too small for the ULP monitor");
+#endif
+
+// Program labels
+#define LBL_CLEAR(c) (10 + (c) * 3)  // channel recovered, clear its latch
+#define LBL_ALERT(c) (11 + (c) * 3)  // channel is in alert
+#define LBL_NEXT(c) (12 + (c) * 3)   // next channel
+#define LBL_NO_RECORD 1              // record not complete yet
+#define LBL_NO_WRAP 2                // ring buffer write pointer did not wrap
+#define LBL_FULL 3                   // ring buffer is full
+#define LBL_CHECK_WAKE 4             // upload interval not elapsed
+#define LBL_WAKE 5                   // wake the main cores
+
+#define ULP_MAX_PROGRAM 384 // program instructions including macros, enough for ULP_MAX_CHANNELS
+_Static_assert(ULP_MAX_PROGRAM <= ULP_PROGRAM_WORDS, "ULP program would overlap its data area");
+
+// R3 holds the word address of the data area for the whole program
+#define DATA_BASE ULP_PROGRAM_WORDS
+
+// Append one instruction, branch macros expand to a marker and the instruction
+#define EMIT(insn)                                                          \
+    do                                                                      \
+    {                                                                       \
+        const ulp_insn_t emit_insn[] = {insn};                              \
+        for (size_t i = 0; i < sizeof(emit_insn) / sizeof(emit_insn[0]); i++) \
+            program[n++] = emit_insn[i];                                    \
+    } while (0)
+
+esp_err_t ulp_monitor_start(const struct ulp_monitor_config *cfg)
+{
+    ulp_insn_t program[ULP_MAX_PROGRAM];
+    int n = 0;
+
+    if (cfg->channels == 0 || cfg->channels > ULP_MAX_CHANNELS)
+        return ESP_ERR_INVALID_ARG;
+
+    // Hand ADC1 over to the ULP
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    for (int c = 0; c < cfg->channels; c++)
+        adc1_config_channel_atten((adc1_channel_t)cfg->adc_channel[c], ADC_ATTEN_DB_11);
+    adc1_ulp_enable();
+
+    EMIT(I_MOVI(R3, DATA_BASE));
+    for (int c = 0; c < cfg->channels; c++)
+    {
+        // R0 = average of the oversampled conversions
+        EMIT(I_MOVI(R1, 0));
+        for (int i = 0; i < (1 << ULP_OVERSAMPLE_SHIFT); i++)
+        {
+            EMIT(I_ADC(R0, 0, cfg->adc_channel[c]));
+            EMIT(I_ADDR(R1, R1, R0));
+        }
+        EMIT(I_RSHI(R0, R1, ULP_OVERSAMPLE_SHIFT));
+        EMIT(I_ST(R0, R3, ULP_VAR_LAST + c));
+        EMIT(I_LD(R1, R3, ULP_VAR_SUM + c));
+        EMIT(I_ADDR(R1, R1, R0));
+        EMIT(I_ST(R1, R3, ULP_VAR_SUM + c));
+        // Threshold with hysteresis
+        int threshold = cfg->threshold[c];
+        if (cfg->alert_high[c])
+        {
+            EMIT(M_BGE(LBL_ALERT(c), threshold));
+            EMIT(M_BL(LBL_CLEAR(c), threshold > ULP_HYSTERESIS ? threshold - ULP_HYSTERESIS : 0));
+        }
+        else
+        {
+            EMIT(M_BL(LBL_ALERT(c), threshold + 1));
+            EMIT(M_BGE(LBL_CLEAR(c), threshold + ULP_HYSTERESIS));
+        }
+        EMIT(M_BX(LBL_NEXT(c)));
+        EMIT(M_LABEL(LBL_CLEAR(c)));
+        EMIT(I_MOVI(R1, 0));
+        EMIT(I_ST(R1, R3, ULP_VAR_LATCH + c));
+        EMIT(M_BX(LBL_NEXT(c)));
+        // Only the first sample in alert wakes the main cores
+        EMIT(M_LABEL(LBL_ALERT(c)));
+        EMIT(I_LD(R0, R3, ULP_VAR_LATCH + c));
+        EMIT(M_BGE(LBL_NEXT(c), 1));
+        EMIT(I_MOVI(R1, 1));
+        EMIT(I_ST(R1, R3, ULP_VAR_LATCH + c));
+        EMIT(I_LD(R0, R3, ULP_VAR_WAKE));
+        EMIT(I_ORI(R0, R0, ULP_WAKE_THRESHOLD));
+        EMIT(I_ST(R0, R3, ULP_VAR_WAKE));
+        EMIT(M_LABEL(LBL_NEXT(c)));
+    }
+
+    // Store a record every ULP_RECORD_SAMPLES samples
+    EMIT(I_LD(R0, R3, ULP_VAR_SAMPLES));
+    EMIT(I_ADDI(R0, R0, 1));
+    EMIT(I_ST(R0, R3, ULP_VAR_SAMPLES));
+    EMIT(M_BL(LBL_NO_RECORD, ULP_RECORD_SAMPLES));
+    EMIT(I_LD(R2, R3, ULP_VAR_WPTR));
+    EMIT(I_ADDR(R2, R2, R3));
+    for (int c = 0; c < cfg->channels; c++)
+    {
+        EMIT(I_LD(R1, R3, ULP_VAR_SUM + c));
+        EMIT(I_ST(R1, R2, ULP_VAR_RING + c));
+    }
+    EMIT(I_MOVI(R1, 0));
+    for (int c = 0; c < cfg->channels; c++)
+        EMIT(I_ST(R1, R3, ULP_VAR_SUM + c));
+    EMIT(I_ST(R1, R3, ULP_VAR_SAMPLES));
+    EMIT(I_LD(R0, R3, ULP_VAR_WPTR));
+    EMIT(I_ADDI(R0, R0, cfg->channels));
+    EMIT(M_BL(LBL_NO_WRAP, ULP_RING_RECORDS * cfg->channels));
+    EMIT(I_MOVI(R0, 0));
+    EMIT(M_LABEL(LBL_NO_WRAP));
+    EMIT(I_ST(R0, R3, ULP_VAR_WPTR));
+    EMIT(I_LD(R0, R3, ULP_VAR_COUNT));
+    EMIT(M_BGE(LBL_FULL, ULP_RING_RECORDS));
+    EMIT(I_ADDI(R0, R0, 1));
+    EMIT(I_ST(R0, R3, ULP_VAR_COUNT));
+    EMIT(M_BL(LBL_NO_RECORD, ULP_RING_RECORDS));
+    EMIT(M_LABEL(LBL_FULL));
+    EMIT(I_LD(R0, R3, ULP_VAR_WAKE));
+    EMIT(I_ORI(R0, R0, ULP_WAKE_FULL));
+    EMIT(I_ST(R0, R3, ULP_VAR_WAKE));
+    EMIT(M_LABEL(LBL_NO_RECORD));
+
+    // Upload interval
+    EMIT(I_LD(R0, R3, ULP_VAR_TICKS));
+    EMIT(I_ADDI(R0, R0, 1));
+    EMIT(I_ST(R0, R3, ULP_VAR_TICKS));
+    EMIT(M_BL(LBL_CHECK_WAKE, cfg->upload_ticks));
+    EMIT(I_LD(R0, R3, ULP_VAR_WAKE));
+    EMIT(I_ORI(R0, R0, ULP_WAKE_INTERVAL));
+    EMIT(I_ST(R0, R3, ULP_VAR_WAKE));
+    EMIT(M_LABEL(LBL_CHECK_WAKE));
+    EMIT(I_LD(R0, R3, ULP_VAR_WAKE));
+    EMIT(M_BGE(LBL_WAKE, 1));
+    EMIT(I_HALT());
+
+    // Wait until the SoC can be woken, then wake it and stop the ULP timer
+    EMIT(M_LABEL(LBL_WAKE));
+    EMIT(I_RD_REG(RTC_CNTL_LOW_POWER_ST_REG, RTC_CNTL_RDY_FOR_WAKEUP_S, RTC_CNTL_RDY_FOR_WAKEUP_S));
+    EMIT(M_BL(LBL_WAKE, 1));
+    EMIT(I_WAKE());
+    EMIT(I_END());
+    EMIT(I_HALT());
+
+    size_t size = n;
+    esp_err_t err = ulp_process_macros_and_load(0, program, &size);
+    if (err != ESP_OK)
+        return err;
+    err = ulp_set_wakeup_period(0, ULP_PERIOD_SECS * 1000000UL);
+    if (err != ESP_OK)
+        return err;
+    err = esp_sleep_enable_ulp_wakeup();
+    if (err != ESP_OK)
+        return err;
+    return ulp_run(0);
+}
+
+void ulp_monitor_read(uint16_t *mem)
+{
+    for (int i = 0; i < ULP_DATA_WORDS; i++)
+        mem[i] = RTC_SLOW_MEM[DATA_BASE + i] & 0xffff;
+}
+
+void ulp_monitor_write(const uint16_t *mem)
+{
+    for (int i = 0; i < ULP_DATA_WORDS; i++)
+        RTC_SLOW_MEM[DATA_BASE + i] = mem[i];
+}
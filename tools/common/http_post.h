@@ -0,0 +1,157 @@
+// Minimal blocking HTTP/1.1 client for the Growbot host tools
+//
+// Sends one json POST per connection with the same headers as the firmware's
+// HTTPClient, and reports transport failures with the same negative codes.
+
+#ifndef GROWBOT_HTTP_POST_H
+#define GROWBOT_HTTP_POST_H
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// HTTPClient compatible transport error codes
+#define HTTPC_ERROR_CONNECTION_REFUSED -1
+#define HTTPC_ERROR_SEND_PAYLOAD_FAILED -3
+#define HTTPC_ERROR_CONNECTION_LOST -5
+#define HTTPC_ERROR_READ_TIMEOUT -11
+
+// Parsed and resolved http:// endpoint
+struct http_url
+{
+    std::string host;
+    std::string port;
+    std::string path;
+    sockaddr_storage addr;
+    socklen_t addr_len = 0;
+};
+
+// Result of one POST
+struct http_result
+{
+    int status;        // HTTP status code, or a negative HTTPC_ERROR_* code
+    double latency_ms; // time from connect to the end of the response
+};
+
+// Parse and resolve an http:// url, returns false if the url is invalid or cannot be resolved
+inline bool parse_http_url(const std::string &url, http_url &out)
+{
+    const std::string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0)
+        return false;
+    std::string rest = url.substr(scheme.size());
+    size_t slash = rest.find('/');
+    std::string hostport = rest.substr(0, slash);
+    out.path = (slash == std::string::npos) ? "/" : rest.substr(slash);
+    size_t colon = hostport.rfind(':');
+    out.host = hostport.substr(0, colon);
+    out.port = (colon == std::string::npos) ? "80" : hostport.substr(colon + 1);
+    if (out.host.empty())
+        return false;
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(out.host.c_str(), out.port.c_str(), &hints, &res) != 0 || res == nullptr)
+        return false;
+    memcpy(&out.addr, res->ai_addr, res->ai_addrlen);
+    out.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+// POST a json body and wait for the complete response
+inline http_result http_post_json(const http_url &url, const std::string &body, int timeout_ms)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&start]()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    int fd = socket(url.addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return {HTTPC_ERROR_CONNECTION_REFUSED, elapsed_ms()};
+    timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const sockaddr *)&url.addr, url.addr_len) != 0)
+    {
+        close(fd);
+        return {HTTPC_ERROR_CONNECTION_REFUSED, elapsed_ms()};
+    }
+
+    std::string request = "POST " + url.path + " HTTP/1.1\r\n" +
+                          "Host: " + url.host + ":" + url.port + "\r\n" +
+                          "User-Agent: ESP32HTTPClient\r\n" +
+                          "Connection: close\r\n" +
+                          "Content-Type: application/json\r\n" +
+                          "Accept: application/json\r\n" +
+                          "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    size_t sent = 0;
+    while (sent < request.size())
+    {
+        ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            close(fd);
+            return {HTTPC_ERROR_SEND_PAYLOAD_FAILED, elapsed_ms()};
+        }
+        sent += n;
+    }
+
+    // Read until the server closes the connection or the announced body is complete
+    std::string response;
+    size_t header_end = std::string::npos;
+    size_t content_length = std::string::npos;
+    char buf[4096];
+    for (;;)
+    {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0)
+        {
+            close(fd);
+            return {response.empty() ? HTTPC_ERROR_READ_TIMEOUT : HTTPC_ERROR_CONNECTION_LOST, elapsed_ms()};
+        }
+        if (n == 0)
+            break;
+        response.append(buf, n);
+        if (header_end == std::string::npos)
+        {
+            header_end = response.find("\r\n\r\n");
+            if (header_end != std::string::npos)
+            {
+                for (size_t pos = response.find("\r\n"); pos < header_end; pos = response.find("\r\n", pos + 2))
+                {
+                    if (strncasecmp(response.c_str() + pos + 2, "Content-Length:", 15) == 0)
+                        content_length = strtoul(response.c_str() + pos + 17, nullptr, 10);
+                }
+            }
+        }
+        if (header_end != std::string::npos && content_length != std::string::npos &&
+            response.size() >= header_end + 4 + content_length)
+            break;
+    }
+    close(fd);
+
+    // Status line: HTTP/1.1 200 OK
+    size_t sp = response.find(' ');
+    if (response.compare(0, 5, "HTTP/") != 0 || sp == std::string::npos)
+        return {HTTPC_ERROR_CONNECTION_LOST, elapsed_ms()};
+    return {atoi(response.c_str() + sp + 1), elapsed_ms()};
+}
+
+#endif // GROWBOT_HTTP_POST_H
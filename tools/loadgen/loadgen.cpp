@@ -0,0 +1,542 @@
+// Growbot fleet load generator
+//
+// Simulates a fleet of remote modules against a Growbot ingestion endpoint.
+// Each module follows the wake cycle of src/main.cpp: it takes a reading every
+// SLEEP_MIN minutes, uploads every UPLOAD_EVERY wakes (or earlier when a reading
+// forces a connect), drains its archived backlog one POST at a time with
+// API_SEND_DELAY_MS spacing within the WAKE_BUDGET_SECS wake budget and archives
+// everything while the network is out.
+// Payloads are built with the firmware's own include/payload.h. The legacy
+// strategy replays the original firmware instead: no wake budget, the backlog
+// drained on connect and deleted whole if its last POST succeeded.
+//
+// Simulated time is compressed with --time-scale, HTTP traffic runs in real time.
+// A wake that is still running when the next one is due makes the module skip
+// that wake rather than run it late, the skipped wakes are reported.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "growbot_config.h"
+#include "http_post.h"
+#include "payload.h"
+
+typedef std::chrono::steady_clock clock_type;
+
+// Upload strategies
+enum upload_strategy
+{
+    STRATEGY_PRIORITY, // live alerts first, then live readings, then the backlog
+    STRATEGY_LEGACY    // original firmware: backlog first on connect with no wake budget, then live readings
+};
+
+// Simulated network outage window in simulated minutes
+struct outage_window
+{
+    double start_min;
+    double length_min;
+};
+
+// Load generator options
+struct options
+{
+    std::string url;
+    http_url endpoint;
+    int modules = 100;
+    int sensors = 1;
+    int sleep_min = SLEEP_MIN;
+    int upload_every = UPLOAD_EVERY;
+    int send_delay_ms = API_SEND_DELAY_MS;
+    double time_scale_ms = 100.0; // wall clock milliseconds per simulated minute
+    double duration_min = 24 * 60;
+    int backlog = 0;
+    int timeout_ms = HTTP_TIMEOUT_MS;
+    int wake_budget_s = WAKE_BUDGET_SECS;
+    unsigned seed = 1;
+    bool alert_latency_field = false; // ALERT_LATENCY_FIELD in src/main.cpp
+    upload_strategy strategy = STRATEGY_PRIORITY;
+    std::vector<outage_window> outages;
+};
+
+// One completed request
+struct request_sample
+{
+    double wall_s;     // completion time since start in seconds
+    double latency_ms; // request latency
+    int status;        // HTTP status or HTTPC_ERROR_* code
+    bool backlog;      // archived reading or live reading
+};
+
+// Shared result collector
+struct results
+{
+    std::mutex lock;
+    std::vector<request_sample> samples;
+    std::vector<double> alert_latency; // wake (simulated boot) to alert accepted, in milliseconds
+    std::atomic<long> archived{0};
+    std::atomic<long> budget_exhausted{0};
+    std::atomic<long> remaining_backlog{0};
+    std::atomic<long> overrun_wakes{0};
+    std::atomic<long> dropped_backlog{0};
+};
+
+static clock_type::time_point run_start;
+
+static double wall_seconds()
+{
+    return std::chrono::duration<double>(clock_type::now() - run_start).count();
+}
+
+static bool in_outage(const options &opt, double t_min)
+{
+    for (const outage_window &o : opt.outages)
+    {
+        if (t_min >= o.start_min && t_min < o.start_min + o.length_min)
+            return true;
+    }
+    return false;
+}
+
+// Simulated remote module
+class module
+{
+public:
+    module(const options &opt, results &res, int index)
+        : opt(opt), res(res), rng(opt.seed * 7919u + index)
+    {
+        char id[8];
+        snprintf(id, sizeof(id), "%04x", (0x1000 + index * 37) & 0xffff);
+        device_id = id;
+        std::uniform_real_distribution<double> phase(0.0, opt.sleep_min);
+        std::uniform_int_distribution<int> start_iter(1, opt.upload_every);
+        std::uniform_int_distribution<int> soil(1200, 2300);
+        offset_min = phase(rng);
+        iter = start_iter(rng);
+        for (int s = 0; s < opt.sensors; s++)
+            soil_value.push_back(soil(rng));
+        battery = 3.9f;
+        // Readings archived before the simulation started
+        for (int i = 0; i < opt.backlog; i++)
+        {
+            double t = -opt.sleep_min * (opt.backlog - i);
+            for (int s = 0; s < opt.sensors; s++)
+            {
+                char status_bit;
+                backlog.push_back(make_reading(s, t, false, status_bit));
+            }
+        }
+    }
+
+    void run()
+    {
+        for (double t = offset_min; t < opt.duration_min; t += opt.sleep_min)
+        {
+            clock_type::time_point due = run_start + std::chrono::microseconds((long long)(t * opt.time_scale_ms * 1000.0));
+            // The previous wake ran into this one (beyond a tenth of a sleep period of thread start-up
+            // slack): a real module would not wake twice in a row, skip it instead of bursting
+            if (clock_type::now() > due + std::chrono::microseconds((long long)(opt.sleep_min * opt.time_scale_ms * 100.0)))
+            {
+                res.overrun_wakes++;
+                continue;
+            }
+            std::this_thread::sleep_until(due);
+            wake(t);
+        }
+        res.remaining_backlog += backlog.size();
+    }
+
+private:
+    const options &opt;
+    results &res;
+    std::mt19937 rng;
+    std::string device_id;
+    double offset_min;
+    int iter;
+    std::vector<int> soil_value;
+    float battery;
+    std::deque<std::string> backlog;
+    bool connected = false;
+    int last_status = 0;
+    unsigned last_alert_latency_ms = 0;
+    clock_type::time_point wake_deadline;
+
+    // Advance the simulated sensors and build the payload for one reading, as make_payload()
+    std::string make_reading(int sensor, double t_min, bool live, char &status_bit)
+    {
+        std::normal_distribution<double> noise(0.0, 15.0);
+        std::uniform_real_distribution<double> chance(0.0, 1.0);
+        // Soil dries slowly and is watered once it gets dry
+        soil_value[sensor] += 4 + (int)noise(rng);
+        if (soil_value[sensor] > 2250 && chance(rng) < 0.2)
+            soil_value[sensor] = 1200;
+        battery = std::max(3.2f, battery - 0.0005f);
+
+        time_t ts = time(nullptr) + (time_t)(t_min * 60.0);
+        struct tm tm_time;
+        gmtime_r(&ts, &tm_time);
+        tm_time.tm_year += 1900;
+        tm_time.tm_mon += 1;
+        char timestamp[20];
+        format_timestamp(timestamp, sizeof(timestamp), &tm_time);
+        char batt_volt[10];
+        format_battery_voltage(batt_volt, sizeof(batt_volt), battery);
+        status_bit = payload_status_bit(soil_value[sensor], batt_volt, false, MOISTURE_WARN_VALUE, BATTERY_WARN_VOLTAGE);
+        struct sensor_payload reading = {device_id.c_str(), 36 - sensor, soil_value[sensor], status_bit, batt_volt,
+                                         get_battery_pct(battery), timestamp, "", VERSION, 0};
+        if (opt.alert_latency_field && live && status_bit != 'A')
+            reading.latency_ms = last_alert_latency_ms;
+        char json[PAYLOAD_MAX_LEN];
+        build_payload(json, sizeof(json), &reading);
+        return json;
+    }
+
+    int budget_remaining_ms()
+    {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(wake_deadline - clock_type::now()).count();
+        return left > 0 ? (int)left : 0;
+    }
+
+    // send_payload(): returns true if the API accepted the reading, the original firmware has no wake budget
+    bool post(const std::string &payload, bool from_backlog)
+    {
+        int budget_ms = opt.strategy == STRATEGY_LEGACY ? opt.timeout_ms : budget_remaining_ms();
+        last_status = 0;
+        if (budget_ms < HTTP_MIN_BUDGET_MS)
+        {
+            res.budget_exhausted++;
+            return false;
+        }
+        http_result r = http_post_json(opt.endpoint, payload, std::min(opt.timeout_ms, budget_ms));
+        last_status = r.status;
+        std::lock_guard<std::mutex> guard(res.lock);
+        res.samples.push_back({wall_seconds(), r.latency_ms, r.status, from_backlog});
+        return r.status == 200;
+    }
+
+    // connect_wifi(): bring the network up unless it is out
+    void connect(double t_min)
+    {
+        if (connected)
+            return;
+        if (in_outage(opt, t_min))
+            return;
+        connected = true;
+        if (opt.strategy == STRATEGY_LEGACY)
+            drain_backlog();
+    }
+
+    // check_datafile(): oldest first, stops at the first failure or when the wake budget runs out,
+    // entries the API refuses for good are set aside
+    void drain_backlog()
+    {
+        if (opt.strategy == STRATEGY_LEGACY)
+        {
+            drain_backlog_legacy();
+            return;
+        }
+        while (!backlog.empty() && budget_remaining_ms() >= HTTP_MIN_BUDGET_MS)
+        {
+            if (!post(backlog.front(), true))
+            {
+                bool rejected = last_status >= 400 && last_status < 500 && last_status != 408 && last_status != 429;
+                if (!rejected)
+                    break;
+            }
+            backlog.pop_front();
+            std::this_thread::sleep_for(std::chrono::milliseconds(opt.send_delay_ms));
+        }
+    }
+
+    // check_datafile() of the original firmware: every entry is sent, then the whole file is deleted
+    // if the last POST succeeded (dropping any that failed before it) and otherwise resent next time
+    void drain_backlog_legacy()
+    {
+        bool last_ok = true;
+        long failed = 0;
+        for (const std::string &line : backlog)
+        {
+            last_ok = post(line, true);
+            if (last_ok)
+                iter = 1;
+            else
+                failed++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(opt.send_delay_ms));
+        }
+        if (last_ok)
+        {
+            res.dropped_backlog += failed;
+            backlog.clear();
+        }
+    }
+
+    // send_payload() for a live reading, archiving it if it cannot be sent unless the caller
+    // archives it later, returns false if the API did not accept it
+    bool send_live(const std::string &reading, char status_bit, clock_type::time_point wake_start, bool defer_archive)
+    {
+        if (connected)
+        {
+            if (post(reading, false))
+            {
+                iter = 1;
+                if (status_bit != 'A')
+                {
+                    double latency_ms = std::chrono::duration<double, std::milli>(clock_type::now() - wake_start).count();
+                    last_alert_latency_ms = (unsigned)latency_ms;
+                    std::lock_guard<std::mutex> guard(res.lock);
+                    res.alert_latency.push_back(latency_ms);
+                }
+                return true;
+            }
+            if (defer_archive)
+                return false;
+        }
+        else if (iter == opt.upload_every)
+            return true;
+        archive(reading);
+        return !connected;
+    }
+
+    void archive(const std::string &reading)
+    {
+        backlog.push_back(reading);
+        res.archived++;
+    }
+
+    void wake(double t_min)
+    {
+        connected = false;
+        // The firmware counts the wake budget and the alert latency from boot, the ADC sampling
+        // before the first POST is not simulated but counted
+        int sampling_ms = opt.sensors * SENSOR_SAMPLES * SENSOR_DELAY_MS + BATTERY_SAMPLES * BATTERY_DELAY_MS;
+        clock_type::time_point wake_start = clock_type::now() - std::chrono::milliseconds(sampling_ms);
+        wake_deadline = wake_start + std::chrono::seconds(opt.wake_budget_s);
+        std::vector<std::string> readings;
+        std::vector<char> status;
+        bool alert = false;
+        for (int s = 0; s < opt.sensors; s++)
+        {
+            char status_bit;
+            readings.push_back(make_reading(s, t_min, true, status_bit));
+            status.push_back(status_bit);
+            if (status_bit != 'A')
+                alert = true;
+        }
+        bool upload_due = iter >= opt.upload_every;
+        if (upload_due)
+            iter = 1;
+        else
+            iter++;
+
+        if (opt.strategy == STRATEGY_LEGACY)
+        {
+            // Original firmware: the backlog drains on connect, before the live readings, and
+            // a connect is forced by low battery or soil <= warning
+            if (upload_due)
+                connect(t_min);
+            if (battery <= BATTERY_WARN_VOLTAGE && iter != 1)
+                connect(t_min);
+            for (int s = 0; s < opt.sensors; s++)
+            {
+                if (soil_value[s] <= MOISTURE_WARN_VALUE && !connected && iter != 1)
+                    connect(t_min);
+                send_live(readings[s], status[s], wake_start, false);
+            }
+            return;
+        }
+
+        // flush_uplink_queue(): alerts first, then normal readings, then the backlog unless the API
+        // failed a live reading, then archive_uplink_queue()
+        if (upload_due || alert)
+            connect(t_min);
+        std::vector<std::string> unsent;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int s = 0; s < opt.sensors; s++)
+            {
+                if ((status[s] != 'A') == (pass == 0) && !send_live(readings[s], status[s], wake_start, true))
+                    unsent.push_back(readings[s]);
+            }
+        }
+        if (connected && unsent.empty())
+            drain_backlog();
+        for (const std::string &reading : unsent)
+            archive(reading);
+    }
+};
+
+static double percentile(std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t idx = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+static void report(const options &opt, results &res, double wall_s)
+{
+    std::vector<double> latency;
+    std::map<int, long> status_count;
+    std::map<long, long> per_second;
+    long ok = 0, backlog_requests = 0;
+    for (const request_sample &s : res.samples)
+    {
+        latency.push_back(s.latency_ms);
+        status_count[s.status]++;
+        per_second[(long)s.wall_s]++;
+        if (s.status == 200)
+            ok++;
+        if (s.backlog)
+            backlog_requests++;
+    }
+    std::sort(latency.begin(), latency.end());
+    long total = res.samples.size();
+    long peak = 0;
+    for (const auto &b : per_second)
+        peak = std::max(peak, b.second);
+
+    printf("modules:            %d x %d sensors, sleep %d min, upload every %d wakes, %s uplink\n", opt.modules, opt.sensors, opt.sleep_min,
+           opt.upload_every, opt.strategy == STRATEGY_LEGACY ? "legacy" : "priority");
+    printf("simulated:          %.0f min in %.1f s wall clock\n", opt.duration_min, wall_s);
+    printf("requests:           %ld (%ld backlog, %ld live)\n", total, backlog_requests, total - backlog_requests);
+    printf("throughput:         %.1f req/s average, %ld req/s peak\n", wall_s > 0 ? total / wall_s : 0.0, peak);
+    printf("latency:            p50 %.1f ms, p99 %.1f ms, max %.1f ms\n", percentile(latency, 50), percentile(latency, 99), latency.empty() ? 0.0 : latency.back());
+    std::sort(res.alert_latency.begin(), res.alert_latency.end());
+    printf("alert latency:      p50 %.1f ms, p99 %.1f ms over %zu alerts\n", percentile(res.alert_latency, 50), percentile(res.alert_latency, 99), res.alert_latency.size());
+    printf("errors:             %ld (%.2f%%)\n", total - ok, total ? 100.0 * (total - ok) / total : 0.0);
+    for (const auto &c : status_count)
+    {
+        if (c.first != 200)
+            printf("  status %4d:       %ld\n", c.first, c.second);
+    }
+    printf("archived readings:  %ld, left in backlog at end: %ld\n", res.archived.load(), res.remaining_backlog.load());
+    printf("budget exhausted:   %ld POSTs skipped\n", res.budget_exhausted.load());
+    printf("dropped backlog:    %ld readings deleted unsent\n", res.dropped_backlog.load());
+    printf("overrun wakes:      %ld skipped, previous wake still running (raise --time-scale)\n", res.overrun_wakes.load());
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s --url http://host:port/path [options]\n"
+            "  --modules N          simulated modules (100)\n"
+            "  --sensors N          soil sensors per module (1)\n"
+            "  --sleep-min M        minutes between wakes (%d)\n"
+            "  --upload-every N     upload every N wakes (%d)\n"
+            "  --send-delay-ms MS   delay between backlog POSTs (%d)\n"
+            "  --time-scale MS      wall clock ms per simulated minute (100)\n"
+            "  --duration-min M     simulated duration in minutes (1440)\n"
+            "  --outage START:LEN   network outage in simulated minutes, repeatable\n"
+            "  --backlog N          archived readings per module at start (0)\n"
+            "  --timeout-ms MS      HTTP timeout (%d)\n"
+            "  --wake-budget-s S    awake time budget per wake (%d)\n"
+            "  --strategy NAME      priority uplink or legacy (original firmware) (priority)\n"
+            "  --alert-latency-field  send the previous alert latency on live alerts (ALERT_LATENCY_FIELD)\n"
+            "  --seed N             random seed (1)\n",
+            name, SLEEP_MIN, UPLOAD_EVERY, API_SEND_DELAY_MS, HTTP_TIMEOUT_MS, WAKE_BUDGET_SECS);
+}
+
+int main(int argc, char **argv)
+{
+    options opt;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--alert-latency-field")
+        {
+            opt.alert_latency_field = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *val = argv[++i];
+        if (arg == "--url")
+            opt.url = val;
+        else if (arg == "--modules")
+            opt.modules = atoi(val);
+        else if (arg == "--sensors")
+            opt.sensors = atoi(val);
+        else if (arg == "--sleep-min")
+            opt.sleep_min = atoi(val);
+        else if (arg == "--upload-every")
+            opt.upload_every = atoi(val);
+        else if (arg == "--send-delay-ms")
+            opt.send_delay_ms = atoi(val);
+        else if (arg == "--time-scale")
+            opt.time_scale_ms = atof(val);
+        else if (arg == "--duration-min")
+            opt.duration_min = atof(val);
+        else if (arg == "--backlog")
+            opt.backlog = atoi(val);
+        else if (arg == "--timeout-ms")
+            opt.timeout_ms = atoi(val);
+        else if (arg == "--wake-budget-s")
+            opt.wake_budget_s = atoi(val);
+        else if (arg == "--strategy" && strcmp(val, "priority") == 0)
+            opt.strategy = STRATEGY_PRIORITY;
+        else if (arg == "--strategy" && strcmp(val, "legacy") == 0)
+            opt.strategy = STRATEGY_LEGACY;
+        else if (arg == "--seed")
+            opt.seed = strtoul(val, nullptr, 10);
+        else if (arg == "--outage")
+        {
+            outage_window o;
+            if (sscanf(val, "%lf:%lf", &o.start_min, &o.length_min) != 2)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            opt.outages.push_back(o);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.url.empty() || !parse_http_url(opt.url, opt.endpoint))
+    {
+        fprintf(stderr, "invalid or unresolvable url: '%s'\n", opt.url.c_str());
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.modules < 1 || opt.sensors < 1 || opt.sleep_min < 1 || opt.upload_every < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opt.wake_budget_s * 1000.0 > opt.sleep_min * opt.time_scale_ms)
+        fprintf(stderr, "warning: a %d s wake budget is longer than the %.1f s between compressed wakes, long drains will skip wakes\n",
+                opt.wake_budget_s, opt.sleep_min * opt.time_scale_ms / 1000.0);
+
+    results res;
+    std::vector<module> fleet;
+    fleet.reserve(opt.modules);
+    for (int i = 0; i < opt.modules; i++)
+        fleet.emplace_back(opt, res, i);
+
+    run_start = clock_type::now();
+    std::vector<std::thread> threads;
+    for (module &m : fleet)
+        threads.emplace_back(&module::run, &m);
+    for (std::thread &t : threads)
+        t.join();
+
+    report(opt, res, wall_seconds());
+    return 0;
+}
@@ -0,0 +1,332 @@
+// SPIFFS image reader and writer for the Growbot host tools
+//
+// Understands the on-flash layout produced by the ESP-IDF SPIFFS component with
+// its default configuration: 256 byte pages, 4096 byte blocks, 32 byte object
+// names, 4 bytes of metadata and magic numbers including the filesystem length.
+
+#ifndef GROWBOT_SPIFFS_IMAGE_H
+#define GROWBOT_SPIFFS_IMAGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define SPIFFS_PAGE_SIZE 256
+#define SPIFFS_BLOCK_SIZE 4096
+#define SPIFFS_PAGES_PER_BLOCK (SPIFFS_BLOCK_SIZE / SPIFFS_PAGE_SIZE)
+#define SPIFFS_LOOKUP_PAGES 1                                             // object lookup pages at the start of each block
+#define SPIFFS_LOOKUP_ENTRIES (SPIFFS_PAGES_PER_BLOCK - SPIFFS_LOOKUP_PAGES) // lookup entries per block
+#define SPIFFS_OBJ_NAME_LEN 32
+#define SPIFFS_META_LEN 4
+#define SPIFFS_PAGE_HEADER_LEN 5                                          // obj_id, span_ix, flags (packed)
+#define SPIFFS_DATA_PAGE_SIZE (SPIFFS_PAGE_SIZE - SPIFFS_PAGE_HEADER_LEN)
+#define SPIFFS_IX_HEADER_LEN (SPIFFS_PAGE_HEADER_LEN + 3 + 4 + 1 + SPIFFS_OBJ_NAME_LEN + SPIFFS_META_LEN)
+#define SPIFFS_IX_HEADER_ENTRIES ((SPIFFS_PAGE_SIZE - SPIFFS_IX_HEADER_LEN) / 2) // data pages referenced by the index header
+#define SPIFFS_IX_PAGE_LEN (SPIFFS_PAGE_HEADER_LEN + 3)
+#define SPIFFS_IX_PAGE_ENTRIES ((SPIFFS_PAGE_SIZE - SPIFFS_IX_PAGE_LEN) / 2)   // data pages referenced by other index pages
+
+#define SPIFFS_OBJ_ID_FREE 0xffff
+#define SPIFFS_OBJ_ID_DELETED 0x0000
+#define SPIFFS_OBJ_ID_IX_FLAG 0x8000
+#define SPIFFS_PIX_FREE 0xffff
+#define SPIFFS_TYPE_FILE 1
+
+// Page header flags, a flag is set by clearing its bit
+#define SPIFFS_PH_FLAG_USED (1 << 0)
+#define SPIFFS_PH_FLAG_FINAL (1 << 1)
+#define SPIFFS_PH_FLAG_INDEX (1 << 2)
+#define SPIFFS_PH_FLAG_IXDELE (1 << 6)
+#define SPIFFS_PH_FLAG_DELET (1 << 7)
+
+// ESP32 partition table
+#define PARTITION_TABLE_OFFSET 0x8000
+#define PARTITION_ENTRY_LEN 32
+#define PARTITION_MAGIC 0x50aa
+#define PARTITION_TYPE_DATA 0x01
+#define PARTITION_SUBTYPE_SPIFFS 0x82
+
+// Object stored in a SPIFFS image
+struct spiffs_object
+{
+    uint16_t obj_id;
+    std::string name;
+    uint32_t size;
+};
+
+class spiffs_image
+{
+public:
+    // Wrap a raw spiffs partition image
+    explicit spiffs_image(std::vector<uint8_t> data)
+        : data(std::move(data))
+    {
+        scan();
+    }
+
+    // Number of blocks carrying a valid magic number, 0 means this is not a spiffs image
+    int valid_blocks() const
+    {
+        return magic_blocks;
+    }
+
+    int block_count() const
+    {
+        return (int)(data.size() / SPIFFS_BLOCK_SIZE);
+    }
+
+    // Magic number stored at the end of each block's lookup page
+    static uint16_t magic(int block_count, int block)
+    {
+        return (uint16_t)(0x20140529 ^ SPIFFS_PAGE_SIZE ^ (block_count - block));
+    }
+
+    std::vector<spiffs_object> objects() const
+    {
+        std::vector<spiffs_object> list;
+        for (const auto &ix : index_pages)
+        {
+            if (ix.first.second != 0)
+                continue;
+            const uint8_t *page = page_ptr(ix.second);
+            spiffs_object obj;
+            obj.obj_id = ix.first.first;
+            obj.size = object_size(page);
+            obj.name = std::string((const char *)page + 13, strnlen((const char *)page + 13, SPIFFS_OBJ_NAME_LEN));
+            list.push_back(obj);
+        }
+        return list;
+    }
+
+    // Read the contents of a file, returns false if there is no such file
+    bool read_file(const std::string &name, std::string &out) const
+    {
+        for (const spiffs_object &obj : objects())
+        {
+            if (obj.name != name)
+                continue;
+            out.clear();
+            uint32_t pages = (obj.size + SPIFFS_DATA_PAGE_SIZE - 1) / SPIFFS_DATA_PAGE_SIZE;
+            for (uint32_t span = 0; span < pages; span++)
+            {
+                uint32_t len = std::min<uint32_t>(SPIFFS_DATA_PAGE_SIZE, obj.size - span * SPIFFS_DATA_PAGE_SIZE);
+                int pix = data_page(obj.obj_id, span);
+                if (pix < 0)
+                {
+                    // A missing page leaves a hole, keep the rest of the file aligned
+                    out.append(len, '\0');
+                    continue;
+                }
+                out.append((const char *)page_ptr(pix) + SPIFFS_PAGE_HEADER_LEN, len);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Locate the spiffs partition in a full flash dump, returns false if there is no partition table
+    static bool find_partition(const std::vector<uint8_t> &flash, size_t &offset, size_t &size)
+    {
+        for (size_t pos = PARTITION_TABLE_OFFSET; pos + PARTITION_ENTRY_LEN <= flash.size() && pos < PARTITION_TABLE_OFFSET + 0x1000; pos += PARTITION_ENTRY_LEN)
+        {
+            const uint8_t *e = flash.data() + pos;
+            if (rd16(e) != PARTITION_MAGIC)
+                break;
+            if (e[2] == PARTITION_TYPE_DATA && e[3] == PARTITION_SUBTYPE_SPIFFS)
+            {
+                offset = rd32(e + 4);
+                size = rd32(e + 8);
+                return offset + size <= flash.size();
+            }
+        }
+        return false;
+    }
+
+    // Build a fresh image holding one file, optionally with pages scattered over the
+    // image and stale deleted copies like a filesystem that has seen updates
+    static std::vector<uint8_t> build(size_t image_size, const std::string &name, const std::string &contents, unsigned scatter_seed)
+    {
+        std::vector<uint8_t> img(image_size, 0xff);
+        int blocks = (int)(image_size / SPIFFS_BLOCK_SIZE);
+        for (int b = 0; b < blocks; b++)
+        {
+            uint8_t *lu = img.data() + (size_t)b * SPIFFS_BLOCK_SIZE;
+            wr16(lu + SPIFFS_PAGE_SIZE - 4, 0); // erase count
+            wr16(lu + SPIFFS_PAGE_SIZE - 2, magic(blocks, b));
+        }
+
+        std::vector<int> free_pages;
+        for (int b = 0; b < blocks; b++)
+        {
+            for (int e = 0; e < SPIFFS_LOOKUP_ENTRIES; e++)
+                free_pages.push_back(b * SPIFFS_PAGES_PER_BLOCK + SPIFFS_LOOKUP_PAGES + e);
+        }
+        std::mt19937 rng(scatter_seed);
+        if (scatter_seed)
+            std::shuffle(free_pages.begin(), free_pages.end(), rng);
+        size_t next_free = 0;
+        int last_pix = 0;
+        auto alloc = [&](uint16_t obj_id, uint16_t span, uint8_t flags) -> uint8_t *
+        {
+            if (next_free >= free_pages.size())
+                return nullptr;
+            int pix = free_pages[next_free++];
+            int b = pix / SPIFFS_PAGES_PER_BLOCK;
+            int e = pix % SPIFFS_PAGES_PER_BLOCK - SPIFFS_LOOKUP_PAGES;
+            uint8_t *lu = img.data() + (size_t)b * SPIFFS_BLOCK_SIZE;
+            uint8_t *page = img.data() + (size_t)pix * SPIFFS_PAGE_SIZE;
+            wr16(lu + e * 2, (flags & SPIFFS_PH_FLAG_DELET) ? obj_id : SPIFFS_OBJ_ID_DELETED);
+            wr16(page, obj_id);
+            wr16(page + 2, span);
+            page[4] = flags;
+            last_pix = pix;
+            return page;
+        };
+
+        const uint16_t obj_id = 1;
+        const uint8_t data_flags = (uint8_t)(0xff & ~SPIFFS_PH_FLAG_USED & ~SPIFFS_PH_FLAG_FINAL);
+        const uint8_t ix_flags = (uint8_t)(data_flags & ~SPIFFS_PH_FLAG_INDEX);
+        const uint8_t deleted = (uint8_t)~SPIFFS_PH_FLAG_DELET;
+        uint32_t data_pages = (uint32_t)((contents.size() + SPIFFS_DATA_PAGE_SIZE - 1) / SPIFFS_DATA_PAGE_SIZE);
+        uint32_t ix_pages = 1 + (data_pages > SPIFFS_IX_HEADER_ENTRIES ? (data_pages - SPIFFS_IX_HEADER_ENTRIES + SPIFFS_IX_PAGE_ENTRIES - 1) / SPIFFS_IX_PAGE_ENTRIES : 0);
+        if (data_pages + ix_pages + (scatter_seed ? 2 : 0) > free_pages.size())
+            return std::vector<uint8_t>();
+
+        if (scatter_seed)
+        {
+            // Stale copies of the index header and the first data page left behind by earlier updates
+            uint8_t *stale = alloc(obj_id | SPIFFS_OBJ_ID_IX_FLAG, 0, ix_flags & deleted);
+            write_ix_header(stale, name, 7);
+            stale = alloc(obj_id, 0, data_flags & deleted);
+            memset(stale + SPIFFS_PAGE_HEADER_LEN, 'x', SPIFFS_DATA_PAGE_SIZE);
+        }
+
+        std::vector<uint8_t *> ix(ix_pages);
+        for (uint32_t i = 0; i < ix_pages; i++)
+        {
+            ix[i] = alloc(obj_id | SPIFFS_OBJ_ID_IX_FLAG, (uint16_t)i, ix_flags);
+            if (i == 0)
+                write_ix_header(ix[i], name, (uint32_t)contents.size());
+        }
+        for (uint32_t span = 0; span < data_pages; span++)
+        {
+            uint8_t *page = alloc(obj_id, (uint16_t)span, data_flags);
+            size_t len = std::min<size_t>(SPIFFS_DATA_PAGE_SIZE, contents.size() - (size_t)span * SPIFFS_DATA_PAGE_SIZE);
+            memcpy(page + SPIFFS_PAGE_HEADER_LEN, contents.data() + (size_t)span * SPIFFS_DATA_PAGE_SIZE, len);
+            if (span < SPIFFS_IX_HEADER_ENTRIES)
+                wr16(ix[0] + SPIFFS_IX_HEADER_LEN + span * 2, (uint16_t)last_pix);
+            else
+            {
+                uint32_t rel = span - SPIFFS_IX_HEADER_ENTRIES;
+                wr16(ix[1 + rel / SPIFFS_IX_PAGE_ENTRIES] + SPIFFS_IX_PAGE_LEN + (rel % SPIFFS_IX_PAGE_ENTRIES) * 2, (uint16_t)last_pix);
+            }
+        }
+        return img;
+    }
+
+private:
+    std::vector<uint8_t> data;
+    int magic_blocks = 0;
+    std::map<std::pair<uint16_t, uint32_t>, int> index_pages; // (obj_id, span) -> page index
+    std::map<std::pair<uint16_t, uint32_t>, int> data_pages;  // (obj_id, span) -> page index
+
+    static uint16_t rd16(const uint8_t *p)
+    {
+        return (uint16_t)(p[0] | (p[1] << 8));
+    }
+
+    static uint32_t rd32(const uint8_t *p)
+    {
+        return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static void wr16(uint8_t *p, uint16_t v)
+    {
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+    }
+
+    static void write_ix_header(uint8_t *page, const std::string &name, uint32_t size)
+    {
+        uint8_t *p = page + 8;
+        p[0] = (uint8_t)size;
+        p[1] = (uint8_t)(size >> 8);
+        p[2] = (uint8_t)(size >> 16);
+        p[3] = (uint8_t)(size >> 24);
+        page[12] = SPIFFS_TYPE_FILE;
+        memset(page + 13, 0, SPIFFS_OBJ_NAME_LEN);
+        memcpy(page + 13, name.data(), std::min<size_t>(name.size(), SPIFFS_OBJ_NAME_LEN - 1));
+    }
+
+    const uint8_t *page_ptr(int pix) const
+    {
+        return data.data() + (size_t)pix * SPIFFS_PAGE_SIZE;
+    }
+
+    static uint32_t object_size(const uint8_t *ix_header)
+    {
+        uint32_t size = rd32(ix_header + 8);
+        return size == 0xffffffff ? 0 : size;
+    }
+
+    // Walk the lookup pages and collect every finalized, not deleted page
+    void scan()
+    {
+        int blocks = block_count();
+        for (int b = 0; b < blocks; b++)
+        {
+            const uint8_t *lu = data.data() + (size_t)b * SPIFFS_BLOCK_SIZE;
+            if (rd16(lu + SPIFFS_PAGE_SIZE - 2) == magic(blocks, b))
+                magic_blocks++;
+            for (int e = 0; e < SPIFFS_LOOKUP_ENTRIES; e++)
+            {
+                uint16_t obj_id = rd16(lu + e * 2);
+                if (obj_id == SPIFFS_OBJ_ID_FREE || obj_id == SPIFFS_OBJ_ID_DELETED)
+                    continue;
+                int pix = b * SPIFFS_PAGES_PER_BLOCK + SPIFFS_LOOKUP_PAGES + e;
+                const uint8_t *page = page_ptr(pix);
+                uint8_t flags = page[4];
+                if (rd16(page) != obj_id)
+                    continue;
+                if ((flags & SPIFFS_PH_FLAG_USED) || (flags & SPIFFS_PH_FLAG_FINAL) || !(flags & SPIFFS_PH_FLAG_DELET))
+                    continue;
+                uint32_t span = rd16(page + 2);
+                if (obj_id & SPIFFS_OBJ_ID_IX_FLAG)
+                {
+                    if ((flags & SPIFFS_PH_FLAG_INDEX) || !(flags & SPIFFS_PH_FLAG_IXDELE))
+                        continue;
+                    index_pages[{(uint16_t)(obj_id & ~SPIFFS_OBJ_ID_IX_FLAG), span}] = pix;
+                }
+                else if (flags & SPIFFS_PH_FLAG_INDEX)
+                    data_pages[{obj_id, span}] = pix;
+            }
+        }
+    }
+
+    // Find the page holding a data span, preferring the object index over the lookup scan
+    int data_page(uint16_t obj_id, uint32_t span) const
+    {
+        uint32_t ix_span = span < SPIFFS_IX_HEADER_ENTRIES ? 0 : 1 + (span - SPIFFS_IX_HEADER_ENTRIES) / SPIFFS_IX_PAGE_ENTRIES;
+        auto ix = index_pages.find({obj_id, ix_span});
+        if (ix != index_pages.end())
+        {
+            const uint8_t *page = page_ptr(ix->second);
+            uint16_t pix = ix_span == 0 ? rd16(page + SPIFFS_IX_HEADER_LEN + span * 2)
+                                        : rd16(page + SPIFFS_IX_PAGE_LEN + ((span - SPIFFS_IX_HEADER_ENTRIES) % SPIFFS_IX_PAGE_ENTRIES) * 2);
+            if (pix != SPIFFS_PIX_FREE && (size_t)(pix + 1) * SPIFFS_PAGE_SIZE <= data.size())
+            {
+                const uint8_t *d = page_ptr(pix);
+                if (rd16(d) == obj_id && rd16(d + 2) == span && (d[4] & SPIFFS_PH_FLAG_DELET) && !(d[4] & SPIFFS_PH_FLAG_USED))
+                    return pix;
+            }
+        }
+        auto dp = data_pages.find({obj_id, span});
+        return dp == data_pages.end() ? -1 : dp->second;
+    }
+};
+
+#endif // GROWBOT_SPIFFS_IMAGE_H
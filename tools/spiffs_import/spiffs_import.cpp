@@ -0,0 +1,451 @@
+// Growbot SPIFFS archive extractor and bulk importer
+//
+// Recovers the /data.txt reading archive from a raw dump of a module's spiffs
+// partition (or a full flash dump, located through the partition table),
+// validates and deduplicates the readings and bulk-inserts them into the
+// Growbot API as json arrays, instead of draining them over the air one POST
+// at a time through check_datafile().
+//
+//   esptool.py read_flash 0x210000 0x180000 spiffs.bin
+//   growbot_spiffs_import import spiffs.bin --url http://growbot:8000/api/sensors/bulk
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http_post.h"
+#include "spiffs_image.h"
+
+#define DATA_FILE "/data.txt"          // archive written by write_spiff()
+#define DATA_POS_FILE "/data.pos"      // offset of the first entry check_datafile() has not sent yet
+#define SPIFFS_PARTITION_SIZE 0x180000 // spiffs partition size in partitions.csv
+#define BATCH_SIZE 500                 // readings per bulk POST
+#define BATCH_RETRIES 3                // attempts per batch before giving up
+#define BATCH_TIMEOUT_MS 30000         // timeout for one bulk POST
+#define MIN_VALID_YEAR 2020            // readings taken before the first NTP sync carry 1970 timestamps
+
+// Import options
+struct options
+{
+    std::string command;
+    std::string image;
+    std::string output;
+    std::string name = DATA_FILE;
+    std::string url;
+    size_t offset = 0;
+    bool offset_set = false;
+    size_t size = SPIFFS_PARTITION_SIZE;
+    bool size_set = false;
+    int batch = BATCH_SIZE;
+    size_t skip = 0;
+    unsigned scatter = 0;
+    bool dry_run = false;
+    bool all = false;
+};
+
+static bool read_binary(const std::string &path, std::vector<uint8_t> &out)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    out.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static bool write_binary(const std::string &path, const void *data, size_t len)
+{
+    std::ofstream out(path, std::ios::binary);
+    out.write((const char *)data, len);
+    return (bool)out;
+}
+
+// Parse a flat json object with string and number values, as built by build_payload()
+static bool parse_flat_json(const std::string &line, std::map<std::string, std::string> &fields)
+{
+    size_t pos = 0;
+    auto skip_ws = [&]()
+    {
+        while (pos < line.size() && isspace((unsigned char)line[pos]))
+            pos++;
+    };
+    auto parse_string = [&](std::string &out) -> bool
+    {
+        if (pos >= line.size() || line[pos] != '"')
+            return false;
+        size_t end = line.find('"', ++pos);
+        if (end == std::string::npos)
+            return false;
+        out = line.substr(pos, end - pos);
+        pos = end + 1;
+        return true;
+    };
+    skip_ws();
+    if (pos >= line.size() || line[pos++] != '{')
+        return false;
+    for (;;)
+    {
+        std::string key, value;
+        skip_ws();
+        if (!parse_string(key))
+            return false;
+        skip_ws();
+        if (pos >= line.size() || line[pos++] != ':')
+            return false;
+        skip_ws();
+        if (pos < line.size() && line[pos] == '"')
+        {
+            if (!parse_string(value))
+                return false;
+        }
+        else
+        {
+            size_t end = line.find_first_of(",}", pos);
+            if (end == std::string::npos)
+                return false;
+            value = line.substr(pos, end - pos);
+            pos = end;
+            char *num_end;
+            strtod(value.c_str(), &num_end);
+            if (value.empty() || *num_end != '\0')
+                return false;
+        }
+        fields[key] = value;
+        skip_ws();
+        if (pos < line.size() && line[pos] == ',')
+        {
+            pos++;
+            continue;
+        }
+        if (pos < line.size() && line[pos] == '}')
+        {
+            pos++;
+            skip_ws();
+            return pos == line.size();
+        }
+        return false;
+    }
+}
+
+static bool in_range(const std::string &value, long lo, long hi)
+{
+    char *end;
+    long v = strtol(value.c_str(), &end, 10);
+    return !value.empty() && *end == '\0' && v >= lo && v <= hi;
+}
+
+// Validate one archived reading, returns an empty string if valid, otherwise the reason
+static std::string validate(const std::string &line, std::map<std::string, std::string> &fields)
+{
+    if (!parse_flat_json(line, fields))
+        return "malformed json";
+    static const char *required[] = {"device_id", "sensor_id", "soil_value", "status_bit", "batt_volt", "batt_pct", "timestamp", "version"};
+    for (const char *key : required)
+    {
+        if (!fields.count(key))
+            return std::string("missing ") + key;
+    }
+    if (fields["device_id"].empty() || fields["device_id"].find_first_not_of("0123456789abcdef") != std::string::npos)
+        return "bad device_id";
+    if (!in_range(fields["sensor_id"], 0, 39))
+        return "bad sensor_id";
+    // 12 bit ADC value plus the calibration ADC_OFFSET
+    if (!in_range(fields["soil_value"], -4095, 2 * 4095))
+        return "bad soil_value";
+    if (fields["status_bit"].size() != 1 || strchr("AMBSD", fields["status_bit"][0]) == nullptr)
+        return "bad status_bit";
+    if (!in_range(fields["batt_pct"], 0, 100))
+        return "bad batt_pct";
+    int year, mon, day, hour, min, sec;
+    char tail;
+    if (sscanf(fields["timestamp"].c_str(), "%4d-%2d-%2d %2d:%2d:%2d%c", &year, &mon, &day, &hour, &min, &sec, &tail) != 6 ||
+        mon < 1 || mon > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+        return "bad timestamp";
+    if (year < MIN_VALID_YEAR)
+        return "clock not set";
+    return "";
+}
+
+// Load the archive file from the image given on the command line
+static bool load_archive(const options &opt, std::string &contents)
+{
+    std::vector<uint8_t> flash;
+    if (!read_binary(opt.image, flash))
+    {
+        fprintf(stderr, "cannot read %s\n", opt.image.c_str());
+        return false;
+    }
+    // The spiffs magic depends on the block count, so the partition size must be exact
+    size_t offset = opt.offset, size = flash.size() - std::min(flash.size(), opt.offset);
+    size_t table_offset = 0, table_size = 0;
+    bool table = spiffs_image::find_partition(flash, table_offset, table_size);
+    if (!opt.offset_set && table)
+    {
+        offset = table_offset;
+        size = table_size;
+        fprintf(stderr, "full flash dump, spiffs partition at 0x%zx size 0x%zx\n", offset, size);
+    }
+    else if (opt.offset_set && table && table_offset == offset && !opt.size_set)
+        size = table_size;
+    else if (opt.offset_set)
+        size = opt.size_set ? opt.size : std::min(size, (size_t)SPIFFS_PARTITION_SIZE);
+    if (offset >= flash.size() || size > flash.size() - offset)
+    {
+        fprintf(stderr, "partition at 0x%zx size 0x%zx is beyond the end of %s\n", offset, size, opt.image.c_str());
+        return false;
+    }
+    spiffs_image fs(std::vector<uint8_t>(flash.begin() + offset, flash.begin() + offset + size));
+    if (fs.valid_blocks() == 0)
+    {
+        fprintf(stderr, "no spiffs magic found in %d blocks, wrong image or offset?\n", fs.block_count());
+        return false;
+    }
+    if (fs.valid_blocks() < fs.block_count())
+        fprintf(stderr, "warning: %d of %d blocks have no valid magic\n", fs.block_count() - fs.valid_blocks(), fs.block_count());
+    if (!fs.read_file(opt.name, contents))
+    {
+        fprintf(stderr, "%s not found, files in image:\n", opt.name.c_str());
+        for (const spiffs_object &obj : fs.objects())
+            fprintf(stderr, "  %s (%u bytes)\n", obj.name.c_str(), obj.size);
+        return false;
+    }
+    // Entries before the saved offset were already sent by the module
+    std::string pos;
+    if (!opt.all && opt.name == DATA_FILE && fs.read_file(DATA_POS_FILE, pos))
+    {
+        size_t sent = strtoul(pos.c_str(), nullptr, 10);
+        if (sent > 0 && sent <= contents.size())
+        {
+            fprintf(stderr, "skipping %zu bytes already sent (%s), --all to keep them\n", sent, DATA_POS_FILE);
+            contents.erase(0, sent);
+        }
+    }
+    return true;
+}
+
+static int cmd_extract(const options &opt)
+{
+    std::string contents;
+    if (!load_archive(opt, contents))
+        return 1;
+    if (opt.output.empty())
+        fwrite(contents.data(), 1, contents.size(), stdout);
+    else if (!write_binary(opt.output, contents.data(), contents.size()))
+    {
+        fprintf(stderr, "cannot write %s\n", opt.output.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_import(const options &opt)
+{
+    std::string contents;
+    if (!load_archive(opt, contents))
+        return 1;
+    http_url url;
+    if (!opt.dry_run && !parse_http_url(opt.url, url))
+    {
+        fprintf(stderr, "invalid or unresolvable url: '%s'\n", opt.url.c_str());
+        return 1;
+    }
+
+    // Validate and deduplicate, check_datafile() used to resend whole files after a failure
+    std::vector<std::string> records;
+    std::set<std::string> seen;
+    std::map<std::string, long> invalid;
+    long lines = 0, duplicates = 0;
+    std::istringstream in(contents);
+    for (std::string line; std::getline(in, line);)
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+        lines++;
+        std::map<std::string, std::string> fields;
+        std::string reason = validate(line, fields);
+        if (!reason.empty())
+        {
+            invalid[reason]++;
+            continue;
+        }
+        std::string key = fields["device_id"] + "|" + fields["sensor_id"] + "|" + fields["timestamp"];
+        if (!seen.insert(key).second)
+        {
+            duplicates++;
+            continue;
+        }
+        records.push_back(line);
+    }
+    long invalid_total = 0;
+    for (const auto &i : invalid)
+        invalid_total += i.second;
+    printf("archive:    %zu bytes, %ld readings\n", contents.size(), lines);
+    printf("valid:      %zu\n", records.size());
+    printf("duplicates: %ld\n", duplicates);
+    printf("invalid:    %ld\n", invalid_total);
+    for (const auto &i : invalid)
+        printf("  %-16s%ld\n", i.first.c_str(), i.second);
+    // Valid readings a failed earlier run already imported, in archive order
+    size_t skip = std::min(opt.skip, records.size());
+    if (skip > 0)
+        printf("skipped:    %zu already imported\n", skip);
+    if (opt.dry_run)
+        return 0;
+
+    // Bulk insert as json arrays
+    size_t imported = 0;
+    for (size_t start = skip; start < records.size(); start += opt.batch)
+    {
+        size_t end = std::min(records.size(), start + (size_t)opt.batch);
+        std::string body = "[";
+        for (size_t i = start; i < end; i++)
+        {
+            if (i > start)
+                body += ",";
+            body += records[i];
+        }
+        body += "]";
+        http_result r = {0, 0.0};
+        for (int attempt = 0; attempt < BATCH_RETRIES; attempt++)
+        {
+            if (attempt > 0)
+                std::this_thread::sleep_for(std::chrono::seconds(1 << (attempt - 1)));
+            r = http_post_json(url, body, BATCH_TIMEOUT_MS);
+            if (r.status >= 200 && r.status < 300)
+                break;
+        }
+        if (r.status < 200 || r.status >= 300)
+        {
+            fprintf(stderr, "batch of readings %zu-%zu failed with status %d, %zu readings imported\n", start, end - 1, r.status, imported);
+            fprintf(stderr, "resume from the same image with --skip %zu\n", start);
+            return 2;
+        }
+        imported += end - start;
+        printf("batch %zu-%zu: status %d in %.0f ms\n", start, end - 1, r.status, r.latency_ms);
+    }
+    printf("imported:   %zu readings\n", imported);
+    return 0;
+}
+
+static int cmd_mkimage(const options &opt)
+{
+    std::vector<uint8_t> contents;
+    if (!read_binary(opt.image, contents))
+    {
+        fprintf(stderr, "cannot read %s\n", opt.image.c_str());
+        return 1;
+    }
+    std::vector<uint8_t> img = spiffs_image::build(opt.size, opt.name, std::string(contents.begin(), contents.end()), opt.scatter);
+    if (img.empty())
+    {
+        fprintf(stderr, "%zu bytes do not fit in a 0x%zx byte image\n", contents.size(), opt.size);
+        return 1;
+    }
+    if (!write_binary(opt.output, img.data(), img.size()))
+    {
+        fprintf(stderr, "cannot write %s\n", opt.output.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s extract IMAGE [-o FILE] [options]\n"
+            "       %s import IMAGE --url URL [--batch N] [--skip N] [--dry-run] [options]\n"
+            "       %s mkimage DATAFILE -o IMAGE [--size N] [--scatter SEED] [--name NAME]\n"
+            "  IMAGE is a raw dump of the spiffs partition or a full flash dump\n"
+            "  --offset N       spiffs partition offset in IMAGE (from the partition table or 0)\n"
+            "  --size N         spiffs partition size with --offset (from the partition table or\n"
+            "                   0x%x), image size for mkimage (0x%x)\n"
+            "  --name NAME      archive file name (%s)\n"
+            "  --all            include entries the module already sent (before %s)\n"
+            "  --batch N        readings per bulk POST (%d)\n"
+            "  --skip N         skip the first N valid readings, imported by a failed earlier run\n"
+            "  --dry-run        validate and deduplicate only\n"
+            "  --scatter SEED   scatter pages and leave stale deleted copies in mkimage\n",
+            name, name, name, SPIFFS_PARTITION_SIZE, SPIFFS_PARTITION_SIZE, DATA_FILE, DATA_POS_FILE, BATCH_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+    options opt;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--dry-run")
+        {
+            opt.dry_run = true;
+            continue;
+        }
+        if (arg == "--all")
+        {
+            opt.all = true;
+            continue;
+        }
+        if (arg.compare(0, 1, "-") != 0)
+        {
+            positional.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *val = argv[++i];
+        if (arg == "-o")
+            opt.output = val;
+        else if (arg == "--name")
+            opt.name = val;
+        else if (arg == "--url")
+            opt.url = val;
+        else if (arg == "--offset")
+        {
+            opt.offset = strtoul(val, nullptr, 0);
+            opt.offset_set = true;
+        }
+        else if (arg == "--size")
+        {
+            opt.size = strtoul(val, nullptr, 0);
+            opt.size_set = true;
+        }
+        else if (arg == "--batch")
+            opt.batch = atoi(val);
+        else if (arg == "--skip")
+            opt.skip = strtoul(val, nullptr, 10);
+        else if (arg == "--scatter")
+            opt.scatter = strtoul(val, nullptr, 0);
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (positional.size() != 2 || opt.batch < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    opt.command = positional[0];
+    opt.image = positional[1];
+    if (opt.command == "extract")
+        return cmd_extract(opt);
+    if (opt.command == "import" && (opt.dry_run || !opt.url.empty()))
+        return cmd_import(opt);
+    if (opt.command == "mkimage" && !opt.output.empty() && opt.size % SPIFFS_BLOCK_SIZE == 0 && opt.size > 0)
+        return cmd_mkimage(opt);
+    usage(argv[0]);
+    return 1;
+}
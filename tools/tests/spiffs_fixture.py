@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+# Independent SPIFFS image generator for the growbot_spiffs_import tests
+#
+# Writes an image the way the SPIFFS runtime in ESP-IDF leaves it, built from the
+# structures in spiffs_nucleus.h rather than from tools/spiffs_import/spiffs_image.h:
+# files are created with an undefined size, appended to in several writes (the
+# last data page is filled in place), and every index header update moves the
+# header to a new page and deletes the old one. A deleted file is left behind too,
+# and orphan data pages from page moves interrupted before the index update, so
+# only a reader that follows the object index gets the file contents right.
+#
+#   spiffs_fixture.py DATAFILE IMAGE [--size N] [--pos N] [--flash-offset N]
+#
+# DATAFILE is stored as /data.txt in three appends, --pos adds a /data.pos file.
+# --flash-offset writes a 4 MB full flash dump instead, with the partition table
+# of partitions.csv and the image as the spiffs partition at that offset.
+
+import argparse
+import struct
+
+PAGE_SIZE = 256
+BLOCK_SIZE = 4096
+PAGES_PER_BLOCK = BLOCK_SIZE // PAGE_SIZE
+LOOKUP_PAGES = 1
+OBJ_NAME_LEN = 32
+META_LEN = 4
+
+# spiffs_page_header {obj_id u16, span_ix u16, flags u8}, packed
+PAGE_HEADER = struct.Struct('<HHB')
+# spiffs_page_object_ix_header: page header, align to 4, size u32, type u8, name, meta
+IX_HEADER = struct.Struct('<HHB3xIB%ds%ds' % (OBJ_NAME_LEN, META_LEN))
+# spiffs_page_object_ix: page header, align to 4
+IX_PAGE = struct.Struct('<HHB3x')
+DATA_LEN = PAGE_SIZE - PAGE_HEADER.size
+IX_HEADER_ENTRIES = (PAGE_SIZE - IX_HEADER.size) // 2
+IX_PAGE_ENTRIES = (PAGE_SIZE - IX_PAGE.size) // 2
+
+FLAG_USED = 0x01
+FLAG_FINAL = 0x02
+FLAG_INDEX = 0x04
+FLAG_IXDELE = 0x40
+FLAG_DELET = 0x80
+OBJ_ID_IX_FLAG = 0x8000
+OBJ_ID_DELETED = 0x0000
+UNDEFINED_LEN = 0xffffffff
+TYPE_FILE = 1
+
+FLASH_SIZE = 0x400000
+# esp_partition_info_t {magic u16, type u8, subtype u8, offset u32, size u32, label, flags u32}
+PARTITION_TABLE_OFFSET = 0x8000
+PARTITION_ENTRY = struct.Struct('<HBBII16sI')
+PARTITION_MAGIC = 0x50aa
+
+
+class Image:
+    def __init__(self, size):
+        self.blocks = size // BLOCK_SIZE
+        self.img = bytearray(b'\xff' * size)
+        for b in range(self.blocks):
+            end = b * BLOCK_SIZE + LOOKUP_PAGES * PAGE_SIZE
+            magic = (0x20140529 ^ PAGE_SIZE ^ (self.blocks - b)) & 0xffff
+            struct.pack_into('<HH', self.img, end - 4, 0, magic)  # erase count, magic
+        self.next_pix = LOOKUP_PAGES
+        self.next_obj_id = 1
+
+    def alloc(self, lookup_id):
+        while self.next_pix % PAGES_PER_BLOCK < LOOKUP_PAGES:
+            self.next_pix += 1
+        pix = self.next_pix
+        self.next_pix += 1
+        block, entry = divmod(pix, PAGES_PER_BLOCK)
+        struct.pack_into('<H', self.img, block * BLOCK_SIZE + (entry - LOOKUP_PAGES) * 2, lookup_id)
+        return pix
+
+    def delete(self, pix):
+        block, entry = divmod(pix, PAGES_PER_BLOCK)
+        struct.pack_into('<H', self.img, block * BLOCK_SIZE + (entry - LOOKUP_PAGES) * 2, OBJ_ID_DELETED)
+        self.img[pix * PAGE_SIZE + 4] &= ~FLAG_DELET & 0xff
+
+    def page(self, pix):
+        return pix * PAGE_SIZE
+
+
+class File:
+    def __init__(self, fs, name):
+        self.fs = fs
+        self.obj_id = fs.next_obj_id
+        fs.next_obj_id += 1
+        self.name = name.encode()
+        self.size = 0
+        self.data_pix = []
+        self.ix_pix = []
+        self.write_index(UNDEFINED_LEN)
+
+    def write_index(self, size):
+        """Write the object index pages, moving each one that already exists."""
+        fs = self.fs
+        flags = 0xff & ~(FLAG_USED | FLAG_FINAL | FLAG_INDEX)
+        ix_pages = 1 + max(0, -(-(len(self.data_pix) - IX_HEADER_ENTRIES) // IX_PAGE_ENTRIES))
+        old = self.ix_pix
+        self.ix_pix = []
+        for span in range(ix_pages):
+            pix = fs.alloc(self.obj_id | OBJ_ID_IX_FLAG)
+            base = fs.page(pix)
+            if span == 0:
+                name = self.name.ljust(OBJ_NAME_LEN, b'\0')
+                IX_HEADER.pack_into(fs.img, base, self.obj_id | OBJ_ID_IX_FLAG, 0, flags, size, TYPE_FILE, name, b'\xff' * META_LEN)
+                refs, offset = self.data_pix[:IX_HEADER_ENTRIES], IX_HEADER.size
+            else:
+                IX_PAGE.pack_into(fs.img, base, self.obj_id | OBJ_ID_IX_FLAG, span, flags)
+                first = IX_HEADER_ENTRIES + (span - 1) * IX_PAGE_ENTRIES
+                refs, offset = self.data_pix[first:first + IX_PAGE_ENTRIES], IX_PAGE.size
+            for i, ref in enumerate(refs):
+                struct.pack_into('<H', fs.img, base + offset + i * 2, ref)
+            self.ix_pix.append(pix)
+        for pix in old:
+            fs.delete(pix)
+
+    def append(self, data):
+        fs = self.fs
+        # Fill the free tail of the last data page in place
+        used = self.size % DATA_LEN
+        if used and self.data_pix:
+            n = min(DATA_LEN - used, len(data))
+            base = fs.page(self.data_pix[-1]) + PAGE_HEADER.size + used
+            fs.img[base:base + n] = data[:n]
+            self.size += n
+            data = data[n:]
+        while data:
+            span = len(self.data_pix)
+            pix = fs.alloc(self.obj_id)
+            base = fs.page(pix)
+            PAGE_HEADER.pack_into(fs.img, base, self.obj_id, span, 0xff & ~FLAG_USED)
+            chunk = data[:DATA_LEN]
+            fs.img[base + PAGE_HEADER.size:base + PAGE_HEADER.size + len(chunk)] = chunk
+            fs.img[base + 4] &= ~FLAG_FINAL & 0xff
+            self.data_pix.append(pix)
+            self.size += len(chunk)
+            data = data[DATA_LEN:]
+        self.write_index(self.size)
+
+    def orphan(self, span):
+        """Leave a finalized copy of a data page with other contents that the index does not reference."""
+        fs = self.fs
+        pix = fs.alloc(self.obj_id)
+        base = fs.page(pix)
+        PAGE_HEADER.pack_into(fs.img, base, self.obj_id, span, 0xff & ~(FLAG_USED | FLAG_FINAL))
+        fs.img[base + PAGE_HEADER.size:base + PAGE_SIZE] = b'#' * DATA_LEN
+
+    def remove(self):
+        for pix in self.data_pix + self.ix_pix:
+            self.fs.delete(pix)
+        self.fs.img[self.fs.page(self.ix_pix[0]) + 4] &= ~FLAG_IXDELE & 0xff
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('datafile')
+    parser.add_argument('image')
+    parser.add_argument('--size', type=lambda v: int(v, 0), default=0x20000)
+    parser.add_argument('--pos', type=int)
+    parser.add_argument('--flash-offset', type=lambda v: int(v, 0))
+    args = parser.parse_args()
+    data = open(args.datafile, 'rb').read()
+
+    fs = Image(args.size)
+    stale = File(fs, '/old.txt')
+    stale.append(b'stale archive\n' * 40)
+    archive = File(fs, '/data.txt')
+    thirds = [0, len(data) // 3 + 17, 2 * len(data) // 3 + 5, len(data)]
+    for start, end in zip(thirds, thirds[1:]):
+        archive.append(data[start:end])
+    stale.remove()
+    for span in (3, len(archive.data_pix) - 2):
+        archive.orphan(span)
+    if args.pos is not None:
+        File(fs, '/data.pos').append(b'%d\r\n' % args.pos)
+    if args.flash_offset is None:
+        open(args.image, 'wb').write(fs.img)
+        return
+    flash = bytearray(b'\xff' * FLASH_SIZE)
+    partitions = [(0x01, 0x02, 0x9000, 0x5000, b'nvs'),
+                  (0x01, 0x01, 0xe000, 0x1000, b'phy_init'),
+                  (0x00, 0x00, 0x10000, 0x200000, b'factory'),
+                  (0x01, 0x82, args.flash_offset, args.size, b'spiffs')]
+    for i, (ptype, subtype, offset, size, label) in enumerate(partitions):
+        PARTITION_ENTRY.pack_into(flash, PARTITION_TABLE_OFFSET + i * PARTITION_ENTRY.size,
+                                  PARTITION_MAGIC, ptype, subtype, offset, size, label, 0)
+    flash[args.flash_offset:args.flash_offset + args.size] = fs.img
+    open(args.image, 'wb').write(flash)
+
+
+if __name__ == '__main__':
+    main()
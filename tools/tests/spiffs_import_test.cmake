@@ -0,0 +1,86 @@
+# growbot_spiffs_import test driver, run by ctest through cmake -P
+#
+#   -DTOOL=growbot_spiffs_import  -DDATA=data.txt  -DWORK=scratch directory
+#   -DMODE=roundtrip   mkimage --scatter, extract and import --dry-run
+#   -DMODE=fixture     image from the independent spiffs_fixture.py (-DPYTHON, -DFIXTURE)
+#   -DMODE=spiffsgen   image from ESP-IDF spiffsgen.py (-DPYTHON, -DSPIFFSGEN)
+
+file(MAKE_DIRECTORY ${WORK})
+
+function(run)
+    execute_process(COMMAND ${ARGN} RESULT_VARIABLE result OUTPUT_VARIABLE out ERROR_VARIABLE err)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${ARGN} failed (${result}):\n${out}${err}")
+    endif()
+    set(out "${out}" PARENT_SCOPE)
+endfunction()
+
+# Extract /data.txt from IMAGE and compare it with the original data file
+function(check_extract image)
+    run(${TOOL} extract ${image} -o ${WORK}/extracted.txt ${ARGN})
+    execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${DATA} ${WORK}/extracted.txt RESULT_VARIABLE differ)
+    if(differ)
+        message(FATAL_ERROR "${image}: extracted archive differs from ${DATA}")
+    endif()
+endfunction()
+
+# Run import --dry-run and check the reported counts
+function(check_import image valid duplicates invalid)
+    run(${TOOL} import ${image} --dry-run ${ARGN})
+    foreach(expect "valid:      ${valid}\n" "duplicates: ${duplicates}\n" "invalid:    ${invalid}\n")
+        string(FIND "${out}" "${expect}" found)
+        if(found EQUAL -1)
+            message(FATAL_ERROR "${image}: expected '${expect}' in:\n${out}")
+        endif()
+    endforeach()
+    set(out "${out}" PARENT_SCOPE)
+endfunction()
+
+# data.txt holds 160 readings: 150 valid, 6 duplicates, 2 without a clock, 1 malformed, 1 bad status
+if(MODE STREQUAL "roundtrip")
+    foreach(seed 0 7)
+        run(${TOOL} mkimage ${DATA} -o ${WORK}/mkimage_${seed}.bin --size 0x10000 --scatter ${seed})
+        check_extract(${WORK}/mkimage_${seed}.bin)
+        check_import(${WORK}/mkimage_${seed}.bin 150 6 4)
+    endforeach()
+    # A failed import names the --skip to resume with, and --skip leaves out that many valid readings
+    check_import(${WORK}/mkimage_7.bin 150 6 4 --skip 140)
+    string(FIND "${out}" "skipped:    140 already imported\n" found)
+    if(found EQUAL -1)
+        message(FATAL_ERROR "--skip 140 not reported in:\n${out}")
+    endif()
+    execute_process(COMMAND ${TOOL} import ${WORK}/mkimage_7.bin --url http://127.0.0.1:9/api/sensors/bulk --batch 50 --skip 20
+                    RESULT_VARIABLE result OUTPUT_QUIET ERROR_VARIABLE err)
+    string(FIND "${err}" "resume from the same image with --skip 20\n" found)
+    if(NOT result EQUAL 2 OR found EQUAL -1)
+        message(FATAL_ERROR "failed import (${result}) did not name the resume point:\n${err}")
+    endif()
+    # The archive must not fit, not silently truncate
+    execute_process(COMMAND ${TOOL} mkimage ${DATA} -o ${WORK}/small.bin --size 0x4000 RESULT_VARIABLE result OUTPUT_QUIET ERROR_QUIET)
+    if(result EQUAL 0)
+        message(FATAL_ERROR "mkimage accepted an archive larger than the image")
+    endif()
+elseif(MODE STREQUAL "fixture")
+    run(${PYTHON} ${FIXTURE} ${DATA} ${WORK}/fixture.bin)
+    check_extract(${WORK}/fixture.bin)
+    check_import(${WORK}/fixture.bin 150 6 4)
+    # The first 10 readings (1830 bytes) were already sent by check_datafile()
+    run(${PYTHON} ${FIXTURE} ${DATA} ${WORK}/fixture_pos.bin --pos 1830)
+    check_import(${WORK}/fixture_pos.bin 141 5 4)
+    check_import(${WORK}/fixture_pos.bin 150 6 4 --all)
+    # Full flash dump, the partition found through the partition table or given with --offset
+    run(${PYTHON} ${FIXTURE} ${DATA} ${WORK}/flash.bin --flash-offset 0x210000)
+    check_extract(${WORK}/flash.bin)
+    check_extract(${WORK}/flash.bin --offset 0x210000)
+    check_extract(${WORK}/flash.bin --offset 0x210000 --size 0x20000)
+    check_import(${WORK}/flash.bin 150 6 4 --offset 0x210000)
+elseif(MODE STREQUAL "spiffsgen")
+    file(REMOVE_RECURSE ${WORK}/spiffsgen)
+    file(MAKE_DIRECTORY ${WORK}/spiffsgen)
+    file(COPY ${DATA} DESTINATION ${WORK}/spiffsgen)
+    run(${PYTHON} ${SPIFFSGEN} 0x10000 ${WORK}/spiffsgen ${WORK}/spiffsgen.bin)
+    check_extract(${WORK}/spiffsgen.bin)
+    check_import(${WORK}/spiffsgen.bin 150 6 4)
+else()
+    message(FATAL_ERROR "unknown MODE '${MODE}'")
+endif()
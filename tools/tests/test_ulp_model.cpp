@@ -0,0 +1,189 @@
+// Unit tests for the ULP monitor model in include/ulp_monitor.h
+//
+// The firmware decodes RTC memory with the same functions, and
+// src/ulp_monitor.c implements ulp_model_step() as a ULP program.
+
+#include <cstdio>
+#include <cstring>
+
+#include "ulp_monitor.h"
+
+static int failures = 0;
+
+#define CHECK_EQ(actual, expected)                                                          \
+    do                                                                                      \
+    {                                                                                       \
+        long a_ = (long)(actual), e_ = (long)(expected);                                    \
+        if (a_ != e_)                                                                       \
+        {                                                                                   \
+            fprintf(stderr, "%s:%d: %s is %ld, expected %ld\n", __FILE__, __LINE__, #actual, \
+                    a_, e_);                                                                \
+            failures++;                                                                     \
+        }                                                                                   \
+    } while (0)
+
+// One soil channel alerting at or above 2100 and the battery alerting at or below 1500
+static ulp_monitor_config test_config(uint16_t upload_ticks)
+{
+    ulp_monitor_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.channels = 2;
+    cfg.threshold[0] = 2100;
+    cfg.alert_high[0] = true;
+    cfg.threshold[1] = 1500;
+    cfg.alert_high[1] = false;
+    cfg.upload_ticks = upload_ticks;
+    return cfg;
+}
+
+static uint16_t step(uint16_t *mem, const ulp_monitor_config &cfg, uint16_t soil, uint16_t battery)
+{
+    uint16_t sample[ULP_MAX_CHANNELS] = {soil, battery};
+    return ulp_model_step(mem, &cfg, sample);
+}
+
+static void test_alert_high_latch_and_hysteresis()
+{
+    uint16_t mem[ULP_DATA_WORDS];
+    ulp_model_init(mem);
+    ulp_monitor_config cfg = test_config(60000);
+    CHECK_EQ(step(mem, cfg, 2099, 2000), 0);
+    CHECK_EQ(step(mem, cfg, 2100, 2000), ULP_WAKE_THRESHOLD);
+    CHECK_EQ(mem[ULP_VAR_LATCH + 0], 1);
+    CHECK_EQ(mem[ULP_VAR_LAST + 0], 2100);
+    ulp_model_drain(mem, true);
+    // Still in alert, or back below the threshold but inside the hysteresis: latched, no new wake
+    CHECK_EQ(step(mem, cfg, 2300, 2000), 0);
+    CHECK_EQ(step(mem, cfg, 2100 - ULP_HYSTERESIS, 2000), 0);
+    CHECK_EQ(step(mem, cfg, 2100, 2000), 0);
+    CHECK_EQ(mem[ULP_VAR_LATCH + 0], 1);
+    // Recovered by more than the hysteresis: the next crossing wakes again
+    CHECK_EQ(step(mem, cfg, 2100 - ULP_HYSTERESIS - 1, 2000), 0);
+    CHECK_EQ(mem[ULP_VAR_LATCH + 0], 0);
+    CHECK_EQ(step(mem, cfg, 2100, 2000), ULP_WAKE_THRESHOLD);
+}
+
+static void test_alert_low_latch_and_hysteresis()
+{
+    uint16_t mem[ULP_DATA_WORDS];
+    ulp_model_init(mem);
+    ulp_monitor_config cfg = test_config(60000);
+    CHECK_EQ(step(mem, cfg, 1800, 1501), 0);
+    CHECK_EQ(step(mem, cfg, 1800, 1500), ULP_WAKE_THRESHOLD);
+    CHECK_EQ(mem[ULP_VAR_LATCH + 1], 1);
+    CHECK_EQ(mem[ULP_VAR_LATCH + 0], 0);
+    ulp_model_drain(mem, true);
+    CHECK_EQ(step(mem, cfg, 1800, 1400), 0);
+    CHECK_EQ(step(mem, cfg, 1800, 1500 + ULP_HYSTERESIS - 1), 0);
+    CHECK_EQ(step(mem, cfg, 1800, 1500), 0);
+    CHECK_EQ(mem[ULP_VAR_LATCH + 1], 1);
+    CHECK_EQ(step(mem, cfg, 1800, 1500 + ULP_HYSTERESIS), 0);
+    CHECK_EQ(mem[ULP_VAR_LATCH + 1], 0);
+    CHECK_EQ(step(mem, cfg, 1800, 1500), ULP_WAKE_THRESHOLD);
+}
+
+static void test_full_after_ring_records()
+{
+    uint16_t mem[ULP_DATA_WORDS];
+    ulp_model_init(mem);
+    ulp_monitor_config cfg = test_config(60000);
+    for (int i = 0; i < ULP_RING_RECORDS * ULP_RECORD_SAMPLES - 1; i++)
+        CHECK_EQ(step(mem, cfg, 1800, 2000), 0);
+    CHECK_EQ(mem[ULP_VAR_COUNT], ULP_RING_RECORDS - 1);
+    CHECK_EQ(step(mem, cfg, 1800, 2000), ULP_WAKE_FULL);
+    CHECK_EQ(mem[ULP_VAR_COUNT], ULP_RING_RECORDS);
+    CHECK_EQ(mem[ULP_VAR_SAMPLES], 0);
+}
+
+static void test_interval_at_upload_ticks()
+{
+    uint16_t mem[ULP_DATA_WORDS];
+    ulp_model_init(mem);
+    ulp_monitor_config cfg = test_config(20);
+    for (int i = 0; i < 19; i++)
+        CHECK_EQ(step(mem, cfg, 1800, 2000), 0);
+    CHECK_EQ(step(mem, cfg, 1800, 2000), ULP_WAKE_INTERVAL);
+    ulp_model_drain(mem, true);
+    CHECK_EQ(mem[ULP_VAR_TICKS], 0);
+    CHECK_EQ(mem[ULP_VAR_WAKE], 0);
+    for (int i = 0; i < 19; i++)
+        CHECK_EQ(step(mem, cfg, 1800, 2000), 0);
+    CHECK_EQ(step(mem, cfg, 1800, 2000), ULP_WAKE_INTERVAL);
+}
+
+static void test_drain_without_upload_keeps_ticks()
+{
+    uint16_t mem[ULP_DATA_WORDS];
+    ulp_model_init(mem);
+    ulp_monitor_config cfg = test_config(100);
+    for (int i = 0; i < 30; i++)
+        step(mem, cfg, 1800, 2000);
+    CHECK_EQ(step(mem, cfg, 2200, 2000), ULP_WAKE_THRESHOLD);
+    CHECK_EQ(mem[ULP_VAR_COUNT], 2);
+    ulp_model_drain(mem, false);
+    CHECK_EQ(mem[ULP_VAR_TICKS], 31);
+    CHECK_EQ(mem[ULP_VAR_COUNT], 0);
+    CHECK_EQ(mem[ULP_VAR_WAKE], 0);
+    // The interval still elapses 100 ticks after the last upload
+    for (int i = 31; i < 99; i++)
+        CHECK_EQ(step(mem, cfg, 1800, 2000), 0);
+    CHECK_EQ(step(mem, cfg, 1800, 2000), ULP_WAKE_INTERVAL);
+}
+
+static void test_records_across_wrap()
+{
+    uint16_t mem[ULP_DATA_WORDS];
+    uint16_t avg[ULP_MAX_CHANNELS];
+    ulp_model_init(mem);
+    ulp_monitor_config cfg = test_config(60000);
+    // Record r holds soil 1000 + r and battery 2000 + r, 4 records more than the ring holds
+    const int total = ULP_RING_RECORDS + 4;
+    for (int r = 0; r < total; r++)
+    {
+        for (int i = 0; i < ULP_RECORD_SAMPLES; i++)
+            step(mem, cfg, (uint16_t)(1000 + r), (uint16_t)(2000 + r));
+    }
+    CHECK_EQ(mem[ULP_VAR_COUNT], ULP_RING_RECORDS);
+    CHECK_EQ(mem[ULP_VAR_WPTR], 4 * cfg.channels);
+    for (int index = 0; index < ULP_RING_RECORDS; index++)
+    {
+        ulp_model_record(mem, cfg.channels, index, avg);
+        CHECK_EQ(avg[0], 1000 + 4 + index);
+        CHECK_EQ(avg[1], 2000 + 4 + index);
+        CHECK_EQ(ulp_model_record_age(mem, index), (ULP_RING_RECORDS - 1 - index) * ULP_RECORD_SAMPLES * ULP_PERIOD_SECS);
+    }
+    // Part of the next record taken: every record is that much older
+    for (int i = 0; i < 5; i++)
+        step(mem, cfg, 1800, 2000);
+    CHECK_EQ(ulp_model_record_age(mem, ULP_RING_RECORDS - 1), 5 * ULP_PERIOD_SECS);
+    ulp_model_record(mem, cfg.channels, ULP_RING_RECORDS - 1, avg);
+    CHECK_EQ(avg[0], 1000 + total - 1);
+    // Complete that record, then after a drain the ring restarts at the write pointer
+    for (int i = 5; i < ULP_RECORD_SAMPLES; i++)
+        step(mem, cfg, 1800, 2000);
+    ulp_model_drain(mem, true);
+    for (int r = 0; r < 3; r++)
+    {
+        for (int i = 0; i < ULP_RECORD_SAMPLES; i++)
+            step(mem, cfg, (uint16_t)(3000 + r), 2000);
+    }
+    CHECK_EQ(mem[ULP_VAR_COUNT], 3);
+    for (int index = 0; index < 3; index++)
+    {
+        ulp_model_record(mem, cfg.channels, index, avg);
+        CHECK_EQ(avg[0], 3000 + index);
+    }
+}
+
+int main()
+{
+    test_alert_high_latch_and_hysteresis();
+    test_alert_low_latch_and_hysteresis();
+    test_full_after_ring_records();
+    test_interval_at_upload_ticks();
+    test_drain_without_upload_keeps_ticks();
+    test_records_across_wrap();
+    if (failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
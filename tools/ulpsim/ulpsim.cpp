@@ -0,0 +1,321 @@
+// Growbot ULP monitor simulator
+//
+// Replays soil and battery readings through the ULP decision logic of
+// include/ulp_monitor.h and through the timer wake cycle of src/main.cpp, and
+// compares main core wakes, radio connects, sampling resolution and the
+// estimated average current of both modes.
+//
+// Readings are synthetic (drying soil with watering, a slowly discharging
+// battery and ADC noise) or replayed from a csv file with one line per ULP
+// period: soil ADC value of each sensor, then the battery voltage.
+// Currents and durations are estimates, override them to match a measured board.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "growbot_config.h"
+#include "payload.h"
+#include "ulp_monitor.h"
+
+// One ULP period of readings
+struct reading
+{
+    std::vector<uint16_t> soil;
+    float battery;
+};
+
+// Simulator options
+struct options
+{
+    double days = 7;
+    int sensors = 1;
+    int sleep_min = SLEEP_MIN;
+    int upload_every = UPLOAD_EVERY;
+    double dry_per_hour = 8;     // synthetic soil drying rate in ADC counts per hour
+    double water_delay_h = 12;   // hours between the moisture warning and watering
+    double noise = 6;            // ADC noise standard deviation
+    std::string csv;
+    unsigned seed = 1;
+    // current and time estimates
+    double sleep_ua = 10;        // deep sleep with RTC timer and RTC memory
+    double divider_ua = 12;      // battery voltage divider
+    double ulp_ua = 1.5;         // ULP runs and ADC conversions, averaged over the period
+    double boot_ma = 40;         // main cores booting and running app_main
+    double boot_ms = 350;        // boot to sleep without sampling or radio
+    double sample_ma = 4;        // sampling with automatic light sleep between ADC reads
+    double radio_ma = 110;       // wifi connected and uploading
+    double radio_s = 6;          // connect, time sync and upload
+};
+
+// Charge and wake counters of one mode
+struct tally
+{
+    long wakes = 0;
+    long connects = 0;
+    long records = 0;
+    double sample_mas = 0; // main cores and ADC, without the radio
+    double radio_mas = 0;
+};
+
+// ADC value of a battery voltage
+static uint16_t battery_adc(float voltage)
+{
+    int adc = battery_voltage_to_adc(voltage);
+    return adc > 4095 ? 4095 : adc;
+}
+
+static bool load_csv(const options &opt, std::vector<reading> &out)
+{
+    FILE *f = fopen(opt.csv.c_str(), "r");
+    if (!f)
+    {
+        fprintf(stderr, "cannot open %s\n", opt.csv.c_str());
+        return false;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        reading r;
+        char *p = line;
+        char *end;
+        for (int s = 0; s < opt.sensors; s++)
+        {
+            long v = strtol(p, &end, 10);
+            if (end == p)
+                break;
+            r.soil.push_back((uint16_t)v);
+            p = end + (*end == ',');
+        }
+        r.battery = strtof(p, &end);
+        if ((int)r.soil.size() == opt.sensors && end != p)
+            out.push_back(r);
+    }
+    fclose(f);
+    return !out.empty();
+}
+
+static void synthesize(const options &opt, std::vector<reading> &out)
+{
+    std::mt19937 rng(opt.seed);
+    std::normal_distribution<double> noise(0, opt.noise);
+    long periods = (long)(opt.days * 24 * 3600 / ULP_PERIOD_SECS);
+    std::vector<double> soil(opt.sensors);
+    std::vector<double> watered_at(opt.sensors, -1);
+    for (int s = 0; s < opt.sensors; s++)
+        soil[s] = 1500 + 150 * s;
+    for (long t = 0; t < periods; t++)
+    {
+        double hours = t * ULP_PERIOD_SECS / 3600.0;
+        reading r;
+        for (int s = 0; s < opt.sensors; s++)
+        {
+            soil[s] += opt.dry_per_hour * ULP_PERIOD_SECS / 3600.0;
+            if (soil[s] >= MOISTURE_WARN_VALUE && watered_at[s] < 0)
+                watered_at[s] = hours + opt.water_delay_h;
+            if (watered_at[s] >= 0 && hours >= watered_at[s])
+            {
+                soil[s] = 1450;
+                watered_at[s] = -1;
+            }
+            double v = soil[s] + noise(rng);
+            r.soil.push_back((uint16_t)std::lround(std::fmin(std::fmax(v, 1), 4095)));
+        }
+        r.battery = (float)(4.05 - 0.6 * hours / (24 * 90));
+        out.push_back(r);
+    }
+}
+
+// Timer wake every sleep_min minutes: sample everything, connect on upload or alert
+static tally run_timer(const options &opt, const std::vector<reading> &in)
+{
+    tally t;
+    int per_wake = opt.sleep_min * 60 / ULP_PERIOD_SECS;
+    double sample_s = (opt.sensors * SENSOR_SAMPLES * SENSOR_DELAY_MS + BATTERY_SAMPLES * BATTERY_DELAY_MS) / 1000.0;
+    int iter = 0;
+    for (size_t i = 0; i < in.size(); i += per_wake)
+    {
+        char batt[10];
+        format_battery_voltage(batt, sizeof(batt), in[i].battery);
+        bool alert = false;
+        for (int s = 0; s < opt.sensors; s++)
+            if (payload_status_bit(in[i].soil[s], batt, false, MOISTURE_WARN_VALUE, BATTERY_WARN_VOLTAGE) != 'A')
+                alert = true;
+        bool upload_due = ++iter >= opt.upload_every;
+        t.wakes++;
+        t.records++;
+        t.sample_mas += opt.boot_ma * opt.boot_ms / 1000.0 + opt.sample_ma * sample_s;
+        if (upload_due || alert)
+        {
+            t.connects++;
+            t.radio_mas += opt.radio_ma * opt.radio_s;
+            iter = 0;
+        }
+    }
+    return t;
+}
+
+// ULP samples every period, the main cores only handle the wakes it raises
+static tally run_ulp(const options &opt, const std::vector<reading> &in, long &threshold_wakes, long &full_wakes)
+{
+    tally t;
+    struct ulp_monitor_config cfg;
+    cfg.channels = opt.sensors + 1;
+    for (int s = 0; s < opt.sensors; s++)
+    {
+        cfg.threshold[s] = MOISTURE_WARN_VALUE;
+        cfg.alert_high[s] = true;
+    }
+    cfg.threshold[opt.sensors] = battery_adc(BATTERY_WARN_VOLTAGE);
+    cfg.alert_high[opt.sensors] = false;
+    cfg.upload_ticks = opt.sleep_min * opt.upload_every * 60 / ULP_PERIOD_SECS;
+    uint16_t mem[ULP_DATA_WORDS];
+    uint16_t sample[ULP_MAX_CHANNELS];
+    ulp_model_init(mem);
+    threshold_wakes = full_wakes = 0;
+    for (const reading &r : in)
+    {
+        for (int s = 0; s < opt.sensors; s++)
+            sample[s] = r.soil[s];
+        sample[opt.sensors] = battery_adc(r.battery);
+        uint16_t reason = ulp_model_step(mem, &cfg, sample);
+        if (!reason)
+            continue;
+        bool upload = reason & (ULP_WAKE_THRESHOLD | ULP_WAKE_INTERVAL);
+        t.wakes++;
+        t.records += mem[ULP_VAR_COUNT];
+        threshold_wakes += (reason & ULP_WAKE_THRESHOLD) != 0;
+        full_wakes += reason == ULP_WAKE_FULL;
+        t.sample_mas += opt.boot_ma * opt.boot_ms / 1000.0;
+        if (upload)
+        {
+            t.connects++;
+            t.radio_mas += opt.radio_ma * opt.radio_s;
+        }
+        ulp_model_drain(mem, upload);
+    }
+    return t;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  --days D             simulated days (7)\n"
+            "  --sensors N          soil sensors (1)\n"
+            "  --sleep-min M        minutes between timer wakes (%d)\n"
+            "  --upload-every N     upload every N timer wakes (%d)\n"
+            "  --dry-per-hour C     synthetic drying rate in ADC counts per hour (8)\n"
+            "  --water-delay-h H    hours from moisture warning to watering (12)\n"
+            "  --noise C            synthetic ADC noise (6)\n"
+            "  --csv FILE           replay readings, one line per %d s: soil values, battery volts\n"
+            "  --seed N             random seed (1)\n"
+            "  --sleep-ua UA        deep sleep current (10)\n"
+            "  --divider-ua UA      battery divider current (12)\n"
+            "  --ulp-ua UA          average ULP monitor current (1.5)\n"
+            "  --boot-ma MA         main core current (40)\n"
+            "  --boot-ms MS         main core time per wake without sampling (350)\n"
+            "  --sample-ma MA       current while sampling in light sleep (4)\n"
+            "  --radio-ma MA        wifi current (110)\n"
+            "  --radio-s S          wifi time per connect (6)\n",
+            name, SLEEP_MIN, UPLOAD_EVERY, ULP_PERIOD_SECS);
+}
+
+int main(int argc, char **argv)
+{
+    options opt;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *val = argv[++i];
+        if (arg == "--days")
+            opt.days = atof(val);
+        else if (arg == "--sensors")
+            opt.sensors = atoi(val);
+        else if (arg == "--sleep-min")
+            opt.sleep_min = atoi(val);
+        else if (arg == "--upload-every")
+            opt.upload_every = atoi(val);
+        else if (arg == "--dry-per-hour")
+            opt.dry_per_hour = atof(val);
+        else if (arg == "--water-delay-h")
+            opt.water_delay_h = atof(val);
+        else if (arg == "--noise")
+            opt.noise = atof(val);
+        else if (arg == "--csv")
+            opt.csv = val;
+        else if (arg == "--seed")
+            opt.seed = strtoul(val, nullptr, 10);
+        else if (arg == "--sleep-ua")
+            opt.sleep_ua = atof(val);
+        else if (arg == "--divider-ua")
+            opt.divider_ua = atof(val);
+        else if (arg == "--ulp-ua")
+            opt.ulp_ua = atof(val);
+        else if (arg == "--boot-ma")
+            opt.boot_ma = atof(val);
+        else if (arg == "--boot-ms")
+            opt.boot_ms = atof(val);
+        else if (arg == "--sample-ma")
+            opt.sample_ma = atof(val);
+        else if (arg == "--radio-ma")
+            opt.radio_ma = atof(val);
+        else if (arg == "--radio-s")
+            opt.radio_s = atof(val);
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opt.sensors < 1 || opt.sensors >= ULP_MAX_CHANNELS || opt.sleep_min < 1 || opt.upload_every < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<reading> in;
+    if (!opt.csv.empty())
+    {
+        if (!load_csv(opt, in))
+            return 1;
+    }
+    else
+        synthesize(opt, in);
+
+    double seconds = (double)in.size() * ULP_PERIOD_SECS;
+    double days = seconds / 86400.0;
+    long threshold_wakes, full_wakes;
+    tally timer = run_timer(opt, in);
+    tally ulp = run_ulp(opt, in, threshold_wakes, full_wakes);
+    double floor_ua = opt.sleep_ua + opt.divider_ua;
+    double timer_sample_ua = timer.sample_mas / seconds * 1000.0;
+    double ulp_sample_ua = opt.ulp_ua + ulp.sample_mas / seconds * 1000.0;
+    double timer_radio_ua = timer.radio_mas / seconds * 1000.0;
+    double ulp_radio_ua = ulp.radio_mas / seconds * 1000.0;
+    double timer_ua = floor_ua + timer_sample_ua + timer_radio_ua;
+    double ulp_avg_ua = floor_ua + ulp_sample_ua + ulp_radio_ua;
+
+    printf("simulated %.1f days, %d sensor(s), %zu ULP periods\n", days, opt.sensors, in.size());
+    printf("%-6s %10s %12s %10s %10s %10s %10s %11s %13s\n", "mode", "wakes/day", "connects/day", "records/h",
+           "sample uA", "radio uA", "sleep uA", "average uA", "days/2000mAh");
+    printf("%-6s %10.1f %12.1f %10.2f %10.2f %10.2f %10.2f %11.2f %13.0f\n", "timer", timer.wakes / days,
+           timer.connects / days, timer.records / days / 24, timer_sample_ua, timer_radio_ua, floor_ua, timer_ua,
+           2000.0 / timer_ua * 1000.0 / 24);
+    printf("%-6s %10.1f %12.1f %10.2f %10.2f %10.2f %10.2f %11.2f %13.0f\n", "ulp", ulp.wakes / days,
+           ulp.connects / days, ulp.records / days / 24, ulp_sample_ua, ulp_radio_ua, floor_ua, ulp_avg_ua,
+           2000.0 / ulp_avg_ua * 1000.0 / 24);
+    printf("ulp wakes: %ld threshold, %ld buffer full only\n", threshold_wakes, full_wakes);
+    printf("sampling current %.1fx lower, average current %.1fx lower\n", timer_sample_ua / ulp_sample_ua,
+           timer_ua / ulp_avg_ua);
+    return 0;
+}